@@ -1,97 +1,4109 @@
 #include <iostream>
 #include <memory>
 #include <pqxx/pqxx>
+#include <libpq-fe.h>
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/basic_file_sink.h>  // Для записи в файл
 #include <vector>
 #include <chrono>
 #include <ctime>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <unordered_map>
+#include <map>
+#include <list>
+#include <functional>
+#include <coroutine>
+#include <optional>
+#include <tuple>
+#include <iterator>
+#include <algorithm>
+#include <utility>
+#include <typeindex>
+#include <array>
+#include <span>
+#include <bit>
+#include <cstdint>
+#include <atomic>
+#include <limits>
+#include <random>
+#include <type_traits>
+#include <unordered_set>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <cstdio>
+#include <cerrno>
+#include <cctype>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
-// Шаблонный класс для работы с PostgreSQL
-template<typename T>
-class DatabaseConnection {
+// Запись интервалов (span) в файл формата Chrome trace-event (JSON Array Format), который открывают
+// Perfetto и about:tracing. События дописываются в файл по мере завершения; закрывающая скобка
+// ставится в stop(), но оба просмотрщика читают и оборванный файл. Пока запись не начата,
+// интервал стоит одной атомарной проверки
+class TraceRecorder {
 public:
-    DatabaseConnection(const std::string& connStr) : conn(connStr) {
-        if (conn.is_open()) {
-            spdlog::info("Connection to database established.");
-        } else {
+    using Clock = std::chrono::steady_clock;
+
+    static TraceRecorder& global() {
+        static TraceRecorder recorder;
+        return recorder;
+    }
+
+    ~TraceRecorder() { stop(); }
+
+    void start(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        closeLocked();
+        out.open(path, std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot open " + path + " for writing.");
+        }
+        out << "[\n";
+        first = true;
+        active = true;
+    }
+
+    void stop() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closeLocked();
+    }
+
+    bool enabled() const { return active.load(std::memory_order_relaxed); }
+
+    // Завершённый интервал (событие "X"): имя, категория, начало и длительность. Интервалы "X"
+    // одного потока должны вкладываться друг в друга, поэтому так пишутся только синхронные вызовы
+    void complete(std::string_view name, std::string_view category, Clock::time_point started, Clock::duration duration,
+                  bool failed = false) {
+        if (!enabled()) {
+            return;
+        }
+        auto dur = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+        write(header(name, category, "X", started) + ",\"dur\":" + std::to_string(dur) +
+              (failed ? ",\"args\":{\"error\":true}}" : "}"));
+    }
+
+    // Асинхронный интервал (пара событий "b"/"e" со своим id): корутины одного цикла событий
+    // перекрываются, не вкладываясь, и каждая такая операция получает в просмотрщике свою дорожку
+    void completeAsync(std::string_view name, std::string_view category, Clock::time_point started,
+                       Clock::duration duration, bool failed = false) {
+        if (!enabled()) {
+            return;
+        }
+        std::string id = ",\"id\":\"0x" + toHex(nextAsyncId++) + "\"";
+        write(header(name, category, "b", started) + id + "}");
+        write(header(name, category, "e", started + duration) + id + (failed ? ",\"args\":{\"error\":true}}" : "}"));
+    }
+
+private:
+    std::string header(std::string_view name, std::string_view category, const char* phase, Clock::time_point at) {
+        auto ts = std::chrono::duration_cast<std::chrono::microseconds>(at.time_since_epoch()).count();
+        return "{\"name\":\"" + escape(name) + "\",\"cat\":\"" + escape(category) + "\",\"ph\":\"" + phase +
+               "\",\"ts\":" + std::to_string(ts) + ",\"pid\":" + std::to_string(getpid()) +
+               ",\"tid\":" + std::to_string(threadId());
+    }
+
+    void write(const std::string& event) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!active) {
+            return;
+        }
+        out << (first ? "" : ",\n") << event;
+        first = false;
+    }
+
+    static std::string toHex(uint64_t value) {
+        char buffer[17];
+        std::snprintf(buffer, sizeof(buffer), "%llx", static_cast<unsigned long long>(value));
+        return buffer;
+    }
+
+    void closeLocked() {
+        if (active) {
+            out << "\n]\n";
+            out.close();
+            active = false;
+        }
+    }
+
+    // Короткий номер потока вместо std::thread::id: просмотрщики ждут число
+    static uint64_t threadId() {
+        static std::atomic<uint64_t> nextId{1};
+        thread_local uint64_t id = nextId++;
+        return id;
+    }
+
+    static std::string escape(std::string_view text) {
+        std::string escaped;
+        escaped.reserve(text.size());
+        for (char c : text) {
+            switch (c) {
+                case '"': escaped += "\\\""; break;
+                case '\\': escaped += "\\\\"; break;
+                case '\n': escaped += "\\n"; break;
+                case '\t': escaped += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        escaped += ' ';
+                    } else {
+                        escaped += c;
+                    }
+            }
+        }
+        return escaped;
+    }
+
+    std::mutex mutex;
+    std::ofstream out;
+    std::atomic<bool> active{false};
+    std::atomic<uint64_t> nextAsyncId{1};
+    bool first = true;
+};
+
+// Интервал трассировки на время жизни объекта
+class TraceSpan {
+public:
+    TraceSpan(std::string_view name, std::string_view category)
+        : name(name), category(category), started(TraceRecorder::Clock::now()) {}
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    ~TraceSpan() {
+        TraceRecorder& recorder = TraceRecorder::global();
+        if (recorder.enabled()) {
+            recorder.complete(name, category, started, TraceRecorder::Clock::now() - started);
+        }
+    }
+
+private:
+    std::string_view name;
+    std::string_view category;
+    TraceRecorder::Clock::time_point started;
+};
+
+// LRU-кеш подготовленных на сервере запросов одного соединения, ключ — текст SQL
+class StatementCache {
+public:
+    explicit StatementCache(size_t capacity = 64) : capacity(capacity) {}
+
+    // Имя подготовленного запроса; при промахе запрос готовится на сервере
+    const std::string& prepare(pqxx::connection& conn, const std::string& sql) {
+        auto it = index.find(sql);
+        if (it != index.end()) {
+            ++hitCount;
+            totalHits().fetch_add(1, std::memory_order_relaxed);
+            lru.splice(lru.begin(), lru, it->second);
+            return it->second->second;
+        }
+
+        ++missCount;
+        totalMisses().fetch_add(1, std::memory_order_relaxed);
+        if (lru.size() >= capacity) {
+            evictOldest(conn);
+        }
+
+        std::string name = "stmt_" + std::to_string(++nextId);
+        conn.prepare(name, sql);
+        lru.emplace_front(sql, std::move(name));
+        index.emplace(sql, lru.begin());
+        return lru.front().second;
+    }
+
+    // Забыть все запросы (например, после DISCARD ALL на сервере); сами запросы не освобождаются
+    void clear() {
+        lru.clear();
+        index.clear();
+    }
+
+    size_t hits() const { return hitCount; }
+    size_t misses() const { return missCount; }
+
+    // Сумма по всем соединениям процесса, для экспорта метрик
+    static std::atomic<uint64_t>& totalHits() {
+        static std::atomic<uint64_t> count{0};
+        return count;
+    }
+
+    static std::atomic<uint64_t>& totalMisses() {
+        static std::atomic<uint64_t> count{0};
+        return count;
+    }
+    size_t size() const { return lru.size(); }
+
+private:
+    void evictOldest(pqxx::connection& conn) {
+        auto& [sql, name] = lru.back();
+        try {
+            conn.unprepare(name);
+        } catch (const std::exception& e) {
+            spdlog::warn("Failed to deallocate prepared statement {}: {}", name, e.what());
+        }
+        index.erase(sql);
+        lru.pop_back();
+    }
+
+    using Entry = std::pair<std::string, std::string>;  // SQL, имя на сервере
+
+    size_t capacity;
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t nextId = 0;
+    size_t hitCount = 0;
+    size_t missCount = 0;
+};
+
+// Соединение из пула вместе со своим кешем запросов: новое соединение начинает с пустым кешем
+struct PooledConnection {
+    explicit PooledConnection(const std::string& connStr) : conn(connStr) {}
+
+    pqxx::connection conn;
+    StatementCache statements;
+};
+
+// Настройки пула соединений
+struct PoolOptions {
+    size_t minSize = 1;                                  // Сколько соединений держать открытыми всегда
+    size_t maxSize = 8;                                  // Верхняя граница (не превышать max_connections сервера)
+    std::chrono::seconds idleTimeout{60};                // Лишние соединения, простаивающие дольше, закрываются
+    std::chrono::seconds validateAfter{5};               // После такого простоя соединение проверяется запросом
+    std::chrono::milliseconds acquireTimeout{5000};      // Сколько ждать свободного соединения
+    std::function<void(pqxx::connection&)> onConnect;    // Подготовка только что открытого соединения
+};
+
+// Пул соединений с PostgreSQL, общий для всех объектов с одной строкой подключения
+class ConnectionPool : public std::enable_shared_from_this<ConnectionPool> {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    using Options = PoolOptions;
+
+    // RAII-дескриптор: соединение возвращается в пул при уничтожении
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(std::shared_ptr<ConnectionPool> pool, std::unique_ptr<PooledConnection> conn)
+            : pool(std::move(pool)), conn(std::move(conn)) {}
+
+        Lease(Lease&& other) noexcept = default;
+        Lease& operator=(Lease&& other) noexcept {
+            if (this != &other) {
+                giveBack();
+                pool = std::move(other.pool);
+                conn = std::move(other.conn);
+                broken = other.broken;
+            }
+            return *this;
+        }
+
+        ~Lease() { giveBack(); }
+
+        pqxx::connection& operator*() const { return conn->conn; }
+        pqxx::connection* operator->() const { return &conn->conn; }
+        explicit operator bool() const { return conn != nullptr; }
+
+        StatementCache& statements() const { return conn->statements; }
+
+        // Соединение не вернётся в пул, а будет закрыто
+        void markBroken() { broken = true; }
+
+    private:
+        void giveBack() {
+            if (pool && conn) {
+                pool->release(std::move(conn), broken);
+            }
+            pool.reset();
+        }
+
+        std::shared_ptr<ConnectionPool> pool;
+        std::unique_ptr<PooledConnection> conn;
+        bool broken = false;
+    };
+
+    // Конструктор не подключается: соединения открываются при первом acquire() или в warmUpAsync()
+    ConnectionPool(std::string connStr, Options options)
+        : connStr(std::move(connStr)), options(std::move(options)) {}
+
+    ~ConnectionPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        openerCv.notify_one();
+        if (opener.joinable()) {
+            // Последняя ссылка на пул могла уйти в самом потоке открытия
+            if (opener.get_id() == std::this_thread::get_id()) {
+                opener.detach();
+            } else {
+                opener.join();
+            }
+        }
+        if (warmer.joinable()) {
+            warmer.join();
+        }
+    }
+
+    // Фоновое открытие minSize соединений (вместе с onConnect), чтобы первый запрос не ждал
+    // рукопожатия. Повторный вызов ничего не делает
+    void warmUpAsync() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!warmer.joinable()) {
+            warmer = std::thread([this] { warmUp(); });
+        }
+    }
+
+    // Один пул на строку подключения на весь процесс
+    static std::shared_ptr<ConnectionPool> shared(const std::string& connStr, Options options = {}) {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        auto& pool = registry()[connStr];
+        if (!pool) {
+            pool = std::make_shared<ConnectionPool>(connStr, options);
+        }
+        return pool;
+    }
+
+    // Все общие пулы процесса, для экспорта метрик
+    static std::vector<std::shared_ptr<ConnectionPool>> all() {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        std::vector<std::shared_ptr<ConnectionPool>> pools;
+        for (const auto& entry : registry()) {
+            pools.push_back(entry.second);
+        }
+        return pools;
+    }
+
+    Lease acquire() {
+        TraceSpan span("pool.acquire", "pool");
+        auto started = Clock::now();
+        Lease lease = waitForConnection();
+        acquisitions.fetch_add(1, std::memory_order_relaxed);
+        waitMicros.fetch_add(static_cast<uint64_t>(
+                                 std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started).count()),
+                             std::memory_order_relaxed);
+        return lease;
+    }
+
+    // Соединение для ждущего tryAcquire, пустой Lease (пробовать заново) или ошибка открытия
+    using Waiter = std::function<void(Lease, std::exception_ptr)>;
+
+    // Выдача без ожидания и без обращений к серверу, для потока цикла событий: только свободное
+    // соединение, которому не нужна проверка живости. Иначе пустой Lease, а whenFree (если задан)
+    // ставится в очередь. Если пул не заполнен или свободное соединение надо проверить, это делает
+    // поток открытия; иначе whenFree дождётся release(). whenFree вызывается в чужом потоке
+    // и не должен блокироваться
+    Lease tryAcquire(Waiter whenFree = {}) {
+        std::lock_guard<std::mutex> lock(mutex);
+        reapIdle();
+        while (!idle.empty() && !idle.back().conn->conn.is_open()) {
+            idle.pop_back();
+            --total;
+            cv.notify_one();
+        }
+        if (!idle.empty() && Clock::now() - idle.back().lastUsed < options.validateAfter) {
+            Entry entry = std::move(idle.back());
+            idle.pop_back();
+            acquisitions.fetch_add(1, std::memory_order_relaxed);
+            return Lease(shared_from_this(), std::move(entry.conn));
+        }
+        if (whenFree) {
+            waiters.push_back(std::move(whenFree));
+            if (!idle.empty() || total < options.maxSize) {
+                ++openerJobs;
+                if (!opener.joinable()) {
+                    opener = std::thread([this] { runOpener(); });
+                }
+                openerCv.notify_one();
+            }
+        }
+        return Lease();
+    }
+
+    const std::string& connectionString() const { return connStr; }
+    uint64_t acquireCount() const { return acquisitions.load(std::memory_order_relaxed); }
+    uint64_t acquireTimeoutCount() const { return timeouts.load(std::memory_order_relaxed); }
+    std::chrono::microseconds totalWait() const { return std::chrono::microseconds(waitMicros.load(std::memory_order_relaxed)); }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return total;
+    }
+
+    size_t idleCount() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return idle.size();
+    }
+
+private:
+    struct Entry {
+        std::unique_ptr<PooledConnection> conn;
+        Clock::time_point lastUsed;
+    };
+
+    Lease waitForConnection() {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto deadline = Clock::now() + options.acquireTimeout;
+
+        while (true) {
+            if (Lease lease = takeIdleOrOpen(lock)) {
+                return lease;
+            }
+
+            if (cv.wait_until(lock, deadline) == std::cv_status::timeout && idle.empty() && total >= options.maxSize) {
+                timeouts.fetch_add(1, std::memory_order_relaxed);
+                spdlog::error("Timed out waiting for a pooled connection.");
+                throw std::runtime_error("Timed out waiting for a pooled connection.");
+            }
+        }
+    }
+
+    // Свободное соединение или новое, если пул не заполнен; иначе пустой Lease, и тогда lock
+    // по-прежнему захвачен
+    Lease takeIdleOrOpen(std::unique_lock<std::mutex>& lock) {
+        reapIdle();
+
+        // Берём самое "свежее" соединение: оно с меньшей вероятностью отвалилось. Проверка может
+        // ходить на сервер, поэтому идёт без блокировки: соединение уже снято с очереди и
+        // по-прежнему учтено в total
+        while (!idle.empty()) {
+            Entry entry = std::move(idle.back());
+            idle.pop_back();
+            lock.unlock();
+            if (isAlive(entry.conn->conn, entry.lastUsed)) {
+                return Lease(shared_from_this(), std::move(entry.conn));
+            }
+            spdlog::warn("Dropping dead pooled connection.");
+            entry.conn.reset();
+            lock.lock();
+            --total;
+            cv.notify_one();
+        }
+
+        if (total < options.maxSize) {
+            ++total;
+            lock.unlock();
+            try {
+                return Lease(shared_from_this(), open());
+            } catch (...) {
+                lock.lock();
+                --total;
+                cv.notify_one();
+                throw;
+            }
+        }
+        return Lease();
+    }
+
+    // Поток открытия: проверяет или открывает соединение для первого ждущего tryAcquire, чтобы
+    // рукопожатие, onConnect и SELECT 1 не шли в потоке цикла событий
+    void runOpener() {
+        while (true) {
+            Lease lease;  // Объявлен до lock: возврат в пул берёт mutex
+            std::exception_ptr error;
+            std::unique_lock<std::mutex> lock(mutex);
+            openerCv.wait(lock, [&] { return stopping || openerJobs > 0; });
+            if (stopping) {
+                return;
+            }
+            --openerJobs;
+            if (waiters.empty()) {
+                continue;  // Ждущего уже обслужил release()
+            }
+            try {
+                lease = takeIdleOrOpen(lock);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            if (!lock.owns_lock()) {
+                lock.lock();
+            }
+            if (!lease && !error) {
+                continue;  // Пул заполнился: ждущий получит соединение из release()
+            }
+            if (waiters.empty()) {
+                continue;
+            }
+            Waiter waiter = std::move(waiters.front());
+            waiters.pop_front();
+            lock.unlock();
+            if (lease) {
+                acquisitions.fetch_add(1, std::memory_order_relaxed);
+            }
+            waiter(std::move(lease), error);
+        }
+    }
+
+    static std::mutex& registryMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::unordered_map<std::string, std::shared_ptr<ConnectionPool>>& registry() {
+        static std::unordered_map<std::string, std::shared_ptr<ConnectionPool>> pools;
+        return pools;
+    }
+
+    void warmUp() {
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (total >= options.minSize) {
+                    return;
+                }
+                ++total;
+            }
+            try {
+                auto conn = open();
+                std::lock_guard<std::mutex> lock(mutex);
+                idle.push_back({std::move(conn), Clock::now()});
+                cv.notify_one();
+            } catch (const std::exception& e) {
+                spdlog::warn("Connection pool warm-up stopped: {}", e.what());
+                std::lock_guard<std::mutex> lock(mutex);
+                --total;
+                cv.notify_one();
+                return;
+            }
+        }
+    }
+
+    std::unique_ptr<PooledConnection> open() {
+        auto conn = std::make_unique<PooledConnection>(connStr);
+        if (!conn->conn.is_open()) {
             spdlog::error("Failed to connect to database.");
             throw std::runtime_error("Failed to connect to database.");
         }
+        spdlog::info("Connection to database established.");
+        if (options.onConnect) {
+            options.onConnect(conn->conn);
+        }
+        return conn;
+    }
+
+    // Соединение уходит первому ждущему tryAcquire, если такой есть, иначе в очередь свободных
+    void release(std::unique_ptr<PooledConnection> conn, bool broken) {
+        Waiter waiter;
+        bool usable = !broken && conn->conn.is_open();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!usable) {
+                --total;
+            }
+            if (!waiters.empty()) {
+                waiter = std::move(waiters.front());
+                waiters.pop_front();
+            } else if (usable) {
+                idle.push_back({std::move(conn), Clock::now()});
+            }
+            reapIdle();
+            cv.notify_one();
+        }
+        if (waiter) {
+            acquisitions.fetch_add(1, std::memory_order_relaxed);
+            waiter(usable ? Lease(shared_from_this(), std::move(conn)) : Lease(), nullptr);
+        }
+    }
+
+    // Проверка живости: is_open() бесплатна, запрос к серверу — только после долгого простоя
+    bool isAlive(pqxx::connection& conn, Clock::time_point lastUsed) const {
+        if (!conn.is_open()) {
+            return false;
+        }
+        if (Clock::now() - lastUsed < options.validateAfter) {
+            return true;
+        }
+        try {
+            pqxx::nontransaction ntx(conn);
+            ntx.exec("SELECT 1");
+            return true;
+        } catch (const std::exception& e) {
+            spdlog::warn("Pooled connection failed liveness check: {}", e.what());
+            return false;
+        }
+    }
+
+    // Вызывается под mutex; самые старые соединения лежат в начале очереди
+    void reapIdle() {
+        auto now = Clock::now();
+        while (total > options.minSize && !idle.empty() && now - idle.front().lastUsed > options.idleTimeout) {
+            idle.pop_front();
+            --total;
+        }
+    }
+
+    std::string connStr;
+    Options options;
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Entry> idle;
+    std::deque<Waiter> waiters;                          // Ждущие tryAcquire, в порядке очереди
+    size_t total = 0;
+    size_t openerJobs = 0;                               // Сколько ждущих ещё не передано потоку открытия
+    bool stopping = false;
+    std::condition_variable openerCv;
+    std::atomic<uint64_t> acquisitions{0};
+    std::atomic<uint64_t> timeouts{0};
+    std::atomic<uint64_t> waitMicros{0};
+    std::thread warmer;
+    std::thread opener;
+};
+
+// Временный доступ к PGconn соединения pqxx для возможностей libpq, которых нет в pqxx
+// (pipeline, неблокирующий режим). Пока объект жив, pqxx::connection пуст и трогать его нельзя;
+// серверная сессия и подготовленные запросы сохраняются
+class RawConnection {
+public:
+    explicit RawConnection(pqxx::connection& conn)
+        : owner(conn), handle(std::move(conn).release_raw_connection()) {}
+
+    RawConnection(const RawConnection&) = delete;
+    RawConnection& operator=(const RawConnection&) = delete;
+
+    ~RawConnection() {
+        owner = pqxx::connection::seize_raw_connection(handle);
+    }
+
+    PGconn* get() const { return handle; }
+
+private:
+    pqxx::connection& owner;
+    PGconn* handle;
+};
+
+using PgResult = std::unique_ptr<PGresult, decltype(&PQclear)>;
+
+// Копирование строк результата libpq в тот же вид, что возвращает executeQuery
+inline std::vector<std::vector<std::string>> rowsOf(const PGresult* res) {
+    std::vector<std::vector<std::string>> rows;
+    int nRows = PQntuples(res);
+    int nCols = PQnfields(res);
+    rows.reserve(nRows);
+    for (int r = 0; r < nRows; ++r) {
+        std::vector<std::string> rowData;
+        rowData.reserve(nCols);
+        for (int c = 0; c < nCols; ++c) {
+            rowData.emplace_back(PQgetvalue(res, r, c), PQgetlength(res, r, c));
+        }
+        rows.push_back(std::move(rowData));
+    }
+    return rows;
+}
+
+// Параметризованный запрос для пакетного выполнения
+struct Statement {
+    std::string sql;
+    std::vector<std::string> params;
+};
+
+// Итог одного запроса из пакета
+struct StatementResult {
+    bool ok = false;
+    std::vector<std::vector<std::string>> rows;
+    std::string error;
+    std::string sqlstate;
+};
+
+// Разбор одного результата libpq в StatementResult
+inline void applyResult(StatementResult& result, const PGresult* res) {
+    switch (PQresultStatus(res)) {
+        case PGRES_TUPLES_OK:
+        case PGRES_COMMAND_OK:
+            result.ok = true;
+            result.rows = rowsOf(res);
+            break;
+        default:
+            result.ok = false;
+            result.error = PQresultErrorMessage(res);
+            if (const char* state = PQresultErrorField(res, PG_DIAG_SQLSTATE)) {
+                result.sqlstate = state;
+            }
+            break;
+    }
+}
+
+// Однопоточный цикл событий на epoll: обработчик сокета вызывается, когда сокет готов
+class EventLoop {
+public:
+    using Handler = std::function<void(uint32_t events)>;
+
+    EventLoop() : epollFd(epoll_create1(EPOLL_CLOEXEC)), wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+        if (epollFd < 0 || wakeFd < 0) {
+            throw std::runtime_error("Failed to create epoll instance.");
+        }
+        control(EPOLL_CTL_ADD, wakeFd, EPOLLIN);
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    ~EventLoop() {
+        close(wakeFd);
+        close(epollFd);
+    }
+
+    // Выполнение task в потоке цикла; можно вызывать из любого потока
+    void post(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(postedMutex);
+            posted.push_back(std::move(task));
+        }
+        uint64_t one = 1;
+        [[maybe_unused]] ssize_t written = write(wakeFd, &one, sizeof(one));
+    }
+
+    // Учёт работы, которая ещё придёт через post() (например, запрос ждёт соединения из пула):
+    // пока она есть, run() не завершается, даже если сокетов не осталось
+    void hold() { ++held; }
+    void unhold() { --held; }
+
+    void add(int fd, uint32_t events, Handler handler) {
+        control(EPOLL_CTL_ADD, fd, events);
+        handlers[fd] = std::move(handler);
+    }
+
+    void modify(int fd, uint32_t events) {
+        control(EPOLL_CTL_MOD, fd, events);
+    }
+
+    void remove(int fd) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        handlers.erase(fd);
+    }
+
+    // Один проход: ждёт события не дольше timeoutMs и вызывает обработчики
+    void runOnce(int timeoutMs = -1) {
+        epoll_event events[64];
+        int n = epoll_wait(epollFd, events, 64, timeoutMs);
+        if (n < 0) {
+            if (errno == EINTR) {
+                return;
+            }
+            throw std::runtime_error("epoll_wait() failed.");
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.fd == wakeFd) {
+                runPosted();
+                continue;
+            }
+            auto it = handlers.find(events[i].data.fd);
+            if (it == handlers.end()) {
+                continue;
+            }
+            // Копия: обработчик может удалить себя из таблицы
+            Handler handler = it->second;
+            handler(events[i].events);
+        }
+    }
+
+    // Работает, пока есть хотя бы один отслеживаемый сокет
+    void run() {
+        while (!empty()) {
+            runOnce();
+        }
+    }
+
+    bool empty() const { return handlers.empty() && held.load() == 0; }
+
+private:
+    void runPosted() {
+        uint64_t count;
+        [[maybe_unused]] ssize_t read = ::read(wakeFd, &count, sizeof(count));
+        std::deque<std::function<void()>> tasks;
+        {
+            std::lock_guard<std::mutex> lock(postedMutex);
+            tasks.swap(posted);
+        }
+        for (auto& task : tasks) {
+            task();
+        }
+    }
+
+    void control(int op, int fd, uint32_t events) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epollFd, op, fd, &ev) < 0) {
+            throw std::runtime_error("epoll_ctl() failed.");
+        }
+    }
+
+    int epollFd;
+    int wakeFd;                                          // eventfd: будит epoll_wait после post()
+    std::unordered_map<int, Handler> handlers;
+    std::mutex postedMutex;
+    std::deque<std::function<void()>> posted;
+    std::atomic<size_t> held{0};
+};
+
+// Запрос, выполняемый через неблокирующий интерфейс libpq на отдельном соединении из пула.
+// Соединение возвращается в пул до вызова callback
+class AsyncQuery : public std::enable_shared_from_this<AsyncQuery> {
+public:
+    using Callback = std::function<void(StatementResult)>;
+
+    AsyncQuery(EventLoop& loop, ConnectionPool::Lease lease, Callback callback)
+        : loop(loop), lease(std::move(lease)), callback(std::move(callback)) {
+        raw = std::make_unique<RawConnection>(*this->lease);
+    }
+
+    // send отправляет запрос одной из функций PQsend* и возвращает её результат
+    void start(const std::function<int(PGconn*)>& send) {
+        PGconn* pg = raw->get();
+        if (PQsetnonblocking(pg, 1) != 0 || send(pg) != 1) {
+            lease.markBroken();
+            throw std::runtime_error(std::string("Failed to send async query: ") + PQerrorMessage(pg));
+        }
+
+        fd = PQsocket(pg);
+        auto self = shared_from_this();
+        loop.add(fd, EPOLLIN | EPOLLOUT, [self](uint32_t events) { self->onReady(events); });
+    }
+
+private:
+    void onReady(uint32_t events) {
+        PGconn* pg = raw->get();
+
+        if (flushing && (events & EPOLLOUT)) {
+            int pending = PQflush(pg);
+            if (pending < 0) {
+                fail(std::string("Failed to flush async query: ") + PQerrorMessage(pg));
+                return;
+            }
+            if (pending == 0) {
+                flushing = false;
+                loop.modify(fd, EPOLLIN);
+            }
+        }
+
+        if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            if (PQconsumeInput(pg) != 1) {
+                fail(std::string("Connection lost during async query: ") + PQerrorMessage(pg));
+                return;
+            }
+            while (!PQisBusy(pg)) {
+                PGresult* next = PQgetResult(pg);
+                if (!next) {
+                    finish();
+                    return;
+                }
+                PgResult res(next, &PQclear);
+                applyResult(result, res.get());
+            }
+        }
+    }
+
+    void fail(const std::string& message) {
+        spdlog::error("{}", message);
+        result.ok = false;
+        result.error = message;
+        lease.markBroken();
+        finish();
+    }
+
+    void finish() {
+        loop.remove(fd);
+        PQsetnonblocking(raw->get(), 0);
+        raw.reset();
+        lease = ConnectionPool::Lease();
+
+        auto done = std::move(callback);
+        done(std::move(result));
+    }
+
+    EventLoop& loop;
+    ConnectionPool::Lease lease;
+    std::unique_ptr<RawConnection> raw;  // Уничтожается раньше lease
+    Callback callback;
+    StatementResult result;
+    int fd = -1;
+    bool flushing = true;
+};
+
+inline pqxx::params toParams(const std::vector<std::string>& params) {
+    pqxx::params result;
+    result.reserve(params.size());
+    for (const auto& param : params) {
+        result.append(param);
+    }
+    return result;
+}
+
+// OID типа, с которым параметр уходит на сервер; 0 — тип выводит сервер из контекста запроса
+template<typename P>
+struct PgParamType;
+
+template<> struct PgParamType<int> { static constexpr Oid oid = 23; };                 // int4
+template<> struct PgParamType<long> { static constexpr Oid oid = 20; };                // int8
+template<> struct PgParamType<long long> { static constexpr Oid oid = 20; };           // int8
+template<> struct PgParamType<double> { static constexpr Oid oid = 701; };             // float8
+template<> struct PgParamType<bool> { static constexpr Oid oid = 16; };                // bool
+template<> struct PgParamType<std::string_view> { static constexpr Oid oid = 0; };
+template<> struct PgParamType<std::span<const int>> { static constexpr Oid oid = 1007; }; // int4[]
+
+// Параметры запроса в двоичном формате PostgreSQL для PQexecParams. Всё хранится внутри объекта:
+// числа кодируются в сетевом порядке байт, строки передаются указателем на данные вызывающего.
+// Строкам тип не задаётся (OID 0), его выводит сервер, поэтому они подходят и для text/varchar,
+// и для enum-столбцов. double уходит как float8 и приводится сервером к numeric при присваивании.
+// Массив int кодируется в отдельный буфер, которым объект тоже владеет
+template<size_t N>
+class BinaryParams {
+public:
+    template<typename... Args>
+    explicit BinaryParams(const Args&... args) {
+        static_assert(sizeof...(Args) == N, "Parameter count mismatch");
+        (bind(args), ...);
+    }
+
+    // valuePtrs указывают в собственный storage: копия или перемещение оставили бы их висячими
+    BinaryParams(const BinaryParams&) = delete;
+    BinaryParams& operator=(const BinaryParams&) = delete;
+
+    int count() const { return static_cast<int>(N); }
+    const Oid* types() const { return typeOids.data(); }
+    const char* const* values() const { return valuePtrs.data(); }
+    const int* lengths() const { return valueLengths.data(); }
+    const int* formats() const { return valueFormats.data(); }
+
+private:
+    void bind(int v) { putNumber(PgParamType<int>::oid, static_cast<uint32_t>(v)); }
+    void bind(long v) { putNumber(PgParamType<long>::oid, static_cast<uint64_t>(v)); }
+    void bind(long long v) { putNumber(PgParamType<long long>::oid, static_cast<uint64_t>(v)); }
+    void bind(double v) { putNumber(PgParamType<double>::oid, std::bit_cast<uint64_t>(v)); }
+    void bind(bool v) { putNumber(PgParamType<bool>::oid, static_cast<uint8_t>(v ? 1 : 0)); }
+    void bind(const char* v) { bind(std::string_view(v)); }
+    void bind(const std::string& v) { bind(std::string_view(v)); }
+
+    void bind(std::string_view v) {
+        put(PgParamType<std::string_view>::oid, v.data(), static_cast<int>(v.size()));
+    }
+
+    // Одномерный int4[] в двоичном формате array_recv: заголовок, размерность, затем элементы
+    void bind(std::span<const int> v) {
+        std::string& buffer = arrays.emplace_back();
+        buffer.reserve(20 + v.size() * 8);
+        auto append = [&](uint32_t bits) {
+            for (int shift = 24; shift >= 0; shift -= 8) {
+                buffer += static_cast<char>(bits >> shift);
+            }
+        };
+        append(1);                                  // Число измерений
+        append(0);                                  // NULL-элементов нет
+        append(PgParamType<int>::oid);
+        append(static_cast<uint32_t>(v.size()));
+        append(1);                                  // Нижняя граница индекса
+        for (int element : v) {
+            append(sizeof(uint32_t));
+            append(static_cast<uint32_t>(element));
+        }
+        put(PgParamType<std::span<const int>>::oid, buffer.data(), static_cast<int>(buffer.size()));
+    }
+
+    template<typename U>
+    void bind(const std::optional<U>& v) {
+        if (v) {
+            bind(*v);
+        } else {
+            put(0, nullptr, 0);
+        }
+    }
+
+    template<typename U>
+    void putNumber(Oid oid, U bits) {
+        char* slot = storage.data() + next * sizeof(uint64_t);
+        for (size_t b = 0; b < sizeof(U); ++b) {
+            slot[b] = static_cast<char>(bits >> (8 * (sizeof(U) - 1 - b)));
+        }
+        put(oid, slot, static_cast<int>(sizeof(U)));
+    }
+
+    void put(Oid oid, const char* data, int length) {
+        typeOids[next] = oid;
+        valuePtrs[next] = data;
+        valueLengths[next] = length;
+        valueFormats[next] = 1;
+        ++next;
+    }
+
+    size_t next = 0;
+    std::array<char, N * sizeof(uint64_t)> storage{};
+    std::array<Oid, N> typeOids{};
+    std::array<const char*, N> valuePtrs{};
+    std::array<int, N> valueLengths{};
+    std::array<int, N> valueFormats{};
+    std::deque<std::string> arrays;     // deque не перемещает уже добавленные буферы
+};
+
+// Проверка результата libpq: ошибки превращаются в те же исключения, что бросает pqxx
+inline void throwIfFailed(const PGresult* res, PGconn* pg, const std::string& query) {
+    if (!res) {
+        throw pqxx::broken_connection(PQerrorMessage(pg));
+    }
+    ExecStatusType status = PQresultStatus(res);
+    if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK) {
+        throw pqxx::sql_error(PQresultErrorMessage(res), query, PQresultErrorField(res, PG_DIAG_SQLSTATE));
+    }
+}
+
+// Наибольший номер параметра $n в тексте запроса
+constexpr int maxPlaceholder(std::string_view sql) {
+    int result = 0;
+    for (size_t i = 0; i < sql.size(); ++i) {
+        if (sql[i] != '$') {
+            continue;
+        }
+        int n = 0;
+        for (size_t j = i + 1; j < sql.size() && sql[j] >= '0' && sql[j] <= '9'; ++j) {
+            n = n * 10 + (sql[j] - '0');
+        }
+        result = std::max(result, n);
+    }
+    return result;
+}
+
+// Аргумент подходит параметру, если им можно инициализировать параметр без сужения
+template<typename Param, typename Arg>
+concept ParamAccepts = requires(const Arg& arg) { Param{arg}; };
+
+// Именованный запрос с типами параметров. Число $n в тексте сверяется с типами при компиляции
+template<typename... Params>
+struct StatementDef {
+    consteval StatementDef(const char* name, const char* sql) : name(name), sql(sql) {
+        if (maxPlaceholder(sql) != static_cast<int>(sizeof...(Params))) {
+            throw "Statement placeholders do not match its parameter types";
+        }
+    }
+
+    template<typename... Args>
+    static constexpr bool accepts() {
+        if constexpr (sizeof...(Args) != sizeof...(Params)) {
+            return false;
+        } else {
+            return (ParamAccepts<Params, Args> && ...);
+        }
+    }
+
+    static constexpr std::array<Oid, sizeof...(Params)> paramTypes{PgParamType<Params>::oid...};
+
+    const char* name;
+    const char* sql;
+};
+
+// Реестр запросов, общих для всех ролей. Все они готовятся на сервере при открытии соединения
+struct Queries {
+    static constexpr StatementDef<int> selectOrderStatus{
+        "select_order_status", "SELECT status FROM orders WHERE order_id = $1"};
+    static constexpr StatementDef<std::string_view> insertOrder{
+        "insert_order", "INSERT INTO orders (status) VALUES ($1)"};
+    static constexpr StatementDef<std::string_view, int> updateOrderStatus{
+        "update_order_status", "UPDATE orders SET status = $1 WHERE order_id = $2"};
+    static constexpr StatementDef<std::string_view, double, int> insertProduct{
+        "insert_product", "INSERT INTO products (name, price, stock_quantity) VALUES ($1, $2, $3)"};
+    static constexpr StatementDef<int> deleteProduct{
+        "delete_product", "DELETE FROM products WHERE product_id = $1"};
+    static constexpr StatementDef<int, int, int> insertOrderItem{
+        "insert_order_item", "INSERT INTO order_items (order_id, product_id, quantity) VALUES ($1, $2, $3)"};
+    static constexpr StatementDef<int, int> deleteOrderItem{
+        "delete_order_item", "DELETE FROM order_items WHERE order_id = $1 AND product_id = $2"};
+
+    // Все строки заказа одним запросом: $2 и $3 — массивы product_id и quantity одинаковой длины
+    static constexpr StatementDef<int, std::span<const int>, std::span<const int>> insertOrderItems{
+        "insert_order_items",
+        "INSERT INTO order_items (order_id, product_id, quantity) "
+        "SELECT $1, line.product_id, line.quantity FROM unnest($2, $3) AS line(product_id, quantity)"};
+
+    // Постраничные выборки: последние два параметра — ключ последней строки прошлой страницы и LIMIT
+    static constexpr StatementDef<std::string_view, int, int> selectOrdersByStatus{
+        "select_orders_by_status",
+        "SELECT order_id, status FROM orders WHERE status = $1 AND order_id > $2 ORDER BY order_id LIMIT $3"};
+    static constexpr StatementDef<int, int> selectCatalog{
+        "select_catalog",
+        "SELECT product_id, name, price::float8, stock_quantity FROM products "
+        "WHERE product_id > $1 ORDER BY product_id LIMIT $2"};
+    static constexpr StatementDef<int, int, int> selectLowStock{
+        "select_low_stock",
+        "SELECT product_id, name, price::float8, stock_quantity FROM products "
+        "WHERE stock_quantity < $1 AND product_id > $2 ORDER BY product_id LIMIT $3"};
+
+    static constexpr auto all = std::tie(selectOrderStatus, insertOrder, updateOrderStatus, insertProduct,
+                                         deleteProduct, insertOrderItem, deleteOrderItem, insertOrderItems,
+                                         selectOrdersByStatus, selectCatalog, selectLowStock);
+};
+
+// Подготовка всех запросов реестра с явными типами параметров (нужны для двоичного формата)
+inline void prepareQueries(pqxx::connection& conn) {
+    RawConnection raw(conn);
+    std::apply([&](const auto&... stmt) {
+        (..., [&](const auto& def) {
+            PgResult res(PQprepare(raw.get(), def.name, def.sql, static_cast<int>(def.paramTypes.size()),
+                                   def.paramTypes.data()),
+                         &PQclear);
+            throwIfFailed(res.get(), raw.get(), def.sql);
+        }(stmt));
+    }, Queries::all);
+}
+
+// Политика повторов при временных ошибках: экспоненциальная задержка со случайным разбросом
+struct RetryPolicy {
+    int maxAttempts = 4;                                 // Включая первую попытку
+    std::chrono::milliseconds baseDelay{20};
+    std::chrono::milliseconds maxDelay{1000};
+
+    // "Full jitter": случайная задержка от нуля до base * 2^(attempt-1), но не больше maxDelay
+    std::chrono::milliseconds delay(int attempt) const {
+        thread_local std::mt19937 rng{std::random_device{}()};
+        auto cap = std::min<int64_t>(maxDelay.count(), baseDelay.count() << std::min(attempt - 1, 20));
+        return std::chrono::milliseconds(std::uniform_int_distribution<int64_t>(0, cap)(rng));
+    }
+};
+
+// Общий на процесс бюджет повторов: повтор тратит жетон, успешный вызов возвращает долю жетона.
+// Когда сервер лежит, бюджет быстро кончается и повторы не умножают на нём нагрузку
+class RetryBudget {
+public:
+    RetryBudget(double maxTokens, double refillPerSuccess)
+        : tokens(maxTokens), maxTokens(maxTokens), refillPerSuccess(refillPerSuccess) {}
+
+    static RetryBudget& global() {
+        static RetryBudget budget(100.0, 0.1);
+        return budget;
+    }
+
+    bool tryWithdraw() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tokens < 1.0) {
+            return false;
+        }
+        tokens -= 1.0;
+        return true;
+    }
+
+    void deposit() {
+        std::lock_guard<std::mutex> lock(mutex);
+        tokens = std::min(maxTokens, tokens + refillPerSuccess);
+    }
+
+private:
+    std::mutex mutex;
+    double tokens;
+    double maxTokens;
+    double refillPerSuccess;
+};
+
+enum class ErrorKind {
+    Transient,       // Сервер откатил запрос: конфликт сериализации (40001), взаимоблокировка (40P01)
+    ConnectionLost,  // Соединение оборвалось; повторять можно, только если запрос точно не зафиксирован
+    Permanent,
+};
+
+inline ErrorKind classifyError(const std::exception& e) {
+    if (dynamic_cast<const pqxx::in_doubt_error*>(&e)) {
+        return ErrorKind::Permanent;  // Обрыв во время COMMIT: исход неизвестен, повтор может задвоить запись
+    }
+    if (dynamic_cast<const pqxx::broken_connection*>(&e)) {
+        return ErrorKind::ConnectionLost;
+    }
+    if (const auto* sql = dynamic_cast<const pqxx::sql_error*>(&e)) {
+        const std::string& state = sql->sqlstate();
+        if (state == "40001" || state == "40P01") {
+            return ErrorKind::Transient;
+        }
+        if (state.rfind("08", 0) == 0 || state == "57P01") {
+            return ErrorKind::ConnectionLost;
+        }
+    }
+    return ErrorKind::Permanent;
+}
+
+// Счётчики ошибок по SQLSTATE за всё время работы процесса. Ошибки без SQLSTATE учитываются
+// как connection_lost (обрыв соединения) или other
+class ErrorCounters {
+public:
+    static ErrorCounters& global() {
+        static ErrorCounters counters;
+        return counters;
+    }
+
+    void record(const std::exception& e) {
+        if (const auto* sql = dynamic_cast<const pqxx::sql_error*>(&e); sql && !sql->sqlstate().empty()) {
+            record(sql->sqlstate());
+        } else if (dynamic_cast<const pqxx::broken_connection*>(&e)) {
+            record("connection_lost");
+        } else {
+            record("other");
+        }
+    }
+
+    void record(const std::string& sqlstate) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++counts[sqlstate.empty() ? "other" : sqlstate];
+    }
+
+    std::map<std::string, uint64_t> snapshot() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counts;
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::map<std::string, uint64_t> counts;
+};
+
+// Запрос не уложился в срок и был отменён на сервере (или не отправлялся, потому что срок уже вышел)
+class DeadlineExceeded : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Общий на процесс сторож сроков: один поток ждёт ближайший срок и отменяет запрос, который
+// к нему не завершился. Отмена (PQcancel) идёт вне мьютекса, а запись на это время помечается
+// как отменяемая; деструктор Timer ждёт завершения только своей отмены, поэтому после разрушения
+// Timer сторож гарантированно больше не тронет соединение
+class QueryWatchdog {
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    // Отмена идёт вне мьютекса: PQcancel открывает TCP-соединение и может висеть долго
+    enum class State { Pending, Cancelling, Done };
+
+    struct Entry {
+        std::function<void()> cancel;
+        State state = State::Pending;
+    };
+    using Entries = std::multimap<Clock::time_point, std::shared_ptr<Entry>>;
+
+public:
+    // Взведённый срок одного запроса; снимается в деструкторе
+    class Timer {
+    public:
+        Timer(QueryWatchdog& owner, Entries::iterator it, std::shared_ptr<Entry> entry)
+            : owner(owner), it(it), entry(std::move(entry)) {}
+
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        // Ждёт только собственную отмену: функция отмены может ссылаться на соединение запроса
+        ~Timer() {
+            std::unique_lock<std::mutex> lock(owner.mutex);
+            if (entry->state == State::Pending) {
+                owner.entries.erase(it);
+                return;
+            }
+            owner.cancelled.wait(lock, [&] { return entry->state == State::Done; });
+        }
+
+        bool fired() const {
+            std::lock_guard<std::mutex> lock(owner.mutex);
+            return entry->state != State::Pending;
+        }
+
+    private:
+        QueryWatchdog& owner;
+        Entries::iterator it;
+        std::shared_ptr<Entry> entry;
+    };
+
+    QueryWatchdog() : worker([this] { run(); }) {}
+
+    QueryWatchdog(const QueryWatchdog&) = delete;
+    QueryWatchdog& operator=(const QueryWatchdog&) = delete;
+
+    ~QueryWatchdog() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        worker.join();
+    }
+
+    static QueryWatchdog& global() {
+        static QueryWatchdog watchdog;
+        return watchdog;
+    }
+
+    Timer arm(Clock::time_point deadline, std::function<void()> cancel) {
+        auto entry = std::make_shared<Entry>();
+        entry->cancel = std::move(cancel);
+        Entries::iterator it;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            it = entries.emplace(deadline, entry);
+        }
+        cv.notify_one();
+        return Timer(*this, it, std::move(entry));
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            if (entries.empty()) {
+                cv.wait(lock);
+                continue;
+            }
+            auto first = entries.begin();
+            if (Clock::now() < first->first) {
+                cv.wait_until(lock, first->first);
+                continue;
+            }
+            auto entry = first->second;
+            entries.erase(first);
+            entry->state = State::Cancelling;
+            lock.unlock();
+            try {
+                entry->cancel();
+            } catch (const std::exception& e) {
+                spdlog::warn("Failed to cancel query past its deadline: {}", e.what());
+            }
+            lock.lock();
+            entry->state = State::Done;
+            cancelled.notify_all();
+        }
+    }
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::condition_variable cancelled;
+    Entries entries;
+    bool stopping = false;
+    std::thread worker;
+};
+
+// Гистограмма задержек в духе HDR: логарифмические диапазоны по 16 линейных корзин в каждом, так что
+// погрешность квантиля не больше 1/16 при любой величине. Запись — пара атомарных инкрементов без
+// блокировок, значения в микросекундах
+class LatencyHistogram {
+public:
+    void record(uint64_t micros) {
+        buckets[bucketOf(micros)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        totalMicros.fetch_add(micros, std::memory_order_relaxed);
+        uint64_t seen = maxSeen.load(std::memory_order_relaxed);
+        while (micros > seen && !maxSeen.compare_exchange_weak(seen, micros, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t max() const { return maxSeen.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return totalMicros.load(std::memory_order_relaxed); }
+
+    // Сколько значений не больше micros (с точностью до корзины), для гистограмм Prometheus
+    uint64_t countAtOrBelow(uint64_t micros) const {
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucketCount && upperBound(i) <= micros; ++i) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+        }
+        return seen;
+    }
+
+    // Верхняя граница корзины, в которую попал квантиль q (0..1)
+    uint64_t percentile(double q) const {
+        uint64_t n = count();
+        if (n == 0) {
+            return 0;
+        }
+        auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * static_cast<double>(n) + 0.999999));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucketCount; ++i) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min(upperBound(i), max());
+            }
+        }
+        return max();
+    }
+
+private:
+    static constexpr unsigned subBits = 4;
+    static constexpr uint64_t subCount = 1u << subBits;
+    static constexpr unsigned maxBits = 40;                 // ~12 суток в микросекундах, дольше — в последнюю корзину
+    static constexpr size_t bucketCount = (maxBits - subBits + 1) * subCount;
+
+    static size_t bucketOf(uint64_t v) {
+        v = std::min(v, (uint64_t{1} << maxBits) - 1);
+        if (v < subCount) {
+            return static_cast<size_t>(v);
+        }
+        unsigned shift = static_cast<unsigned>(std::bit_width(v)) - subBits - 1;
+        return static_cast<size_t>((shift + 1) * subCount + ((v >> shift) & (subCount - 1)));
+    }
+
+    static uint64_t upperBound(size_t bucket) {
+        if (bucket < subCount) {
+            return bucket;
+        }
+        unsigned shift = static_cast<unsigned>(bucket / subCount) - 1;
+        return ((subCount + bucket % subCount + 1) << shift) - 1;
+    }
+
+    std::array<std::atomic<uint64_t>, bucketCount> buckets{};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> totalMicros{0};
+    std::atomic<uint64_t> maxSeen{0};
+};
+
+// Счётчики одного запроса (или операции роли): задержка, строки, байты результата, ошибки
+struct StatementStats {
+    std::string name;
+    const char* category;                                // "statement" или "operation", для трассировки
+    LatencyHistogram latency;
+    std::atomic<uint64_t> rows{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> errors{0};
+};
+
+// Текст SQL без литералов: строки и числа заменяются на ?, пробелы схлопываются. Запросы, которые
+// отличаются только значениями, попадают в одну запись статистики
+inline std::string normalizeSql(std::string_view sql) {
+    std::string out;
+    out.reserve(sql.size());
+    auto isWord = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$'; };
+    for (size_t i = 0; i < sql.size();) {
+        char c = sql[i];
+        if (c == '\'') {
+            // Строковый литерал; '' внутри — экранированная кавычка
+            for (++i; i < sql.size(); ++i) {
+                if (sql[i] == '\'') {
+                    if (i + 1 < sql.size() && sql[i + 1] == '\'') {
+                        ++i;
+                        continue;
+                    }
+                    break;
+                }
+            }
+            ++i;
+            out += '?';
+        } else if (std::isdigit(static_cast<unsigned char>(c)) && (out.empty() || !isWord(out.back()))) {
+            while (i < sql.size() && (std::isalnum(static_cast<unsigned char>(sql[i])) || sql[i] == '.')) {
+                ++i;
+            }
+            out += '?';
+        } else if (std::isspace(static_cast<unsigned char>(c))) {
+            while (i < sql.size() && std::isspace(static_cast<unsigned char>(sql[i]))) {
+                ++i;
+            }
+            if (!out.empty()) {
+                out += ' ';
+            }
+        } else {
+            out += c;
+            ++i;
+        }
+    }
+    while (!out.empty() && out.back() == ' ') {
+        out.pop_back();
+    }
+    return out;
+}
+
+// Общая на процесс статистика: запросы реестра по имени, прочие по нормализованному тексту SQL,
+// операции ролей по имени "Роль.метод". Записи не удаляются, ссылки на них действительны до конца
+// программы. Произвольных текстов не больше maxAdhocKeys, остальные идут в одну общую запись
+class QueryMetrics {
+public:
+    static QueryMetrics& global() {
+        static QueryMetrics metrics;
+        return metrics;
+    }
+
+    // Запрос реестра: запись ищется один раз на поток, дальше по адресу StatementDef без мьютекса
+    template<typename... Params>
+    StatementStats& statement(const StatementDef<Params...>& stmt) {
+        thread_local std::unordered_map<const void*, StatementStats*> cache;
+        auto& stats = cache[&stmt];
+        if (!stats) {
+            stats = &find(statements, stmt.name, "statement");
+        }
+        return *stats;
+    }
+
+    // Произвольный SQL: нормализация и общий мьютекс только при промахе ограниченного кэша потока
+    StatementStats& adhoc(const std::string& sql) {
+        thread_local std::unordered_map<std::string, StatementStats*> cache;
+        if (auto it = cache.find(sql); it != cache.end()) {
+            return *it->second;
+        }
+        if (cache.size() >= maxAdhocKeys) {
+            cache.clear();
+        }
+        std::string key = normalizeSql(sql);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!statements.count(key)) {
+            if (adhocKeys >= maxAdhocKeys) {
+                key = "(other ad-hoc SQL)";
+            } else {
+                ++adhocKeys;
+            }
+        }
+        StatementStats& stats = create(statements, key, "statement");
+        cache.emplace(sql, &stats);
+        return stats;
+    }
+
+    // Операция роли: name — строковый литерал, запись ищется один раз на поток по его адресу
+    StatementStats& operation(const char* name) {
+        thread_local std::unordered_map<const void*, StatementStats*> cache;
+        auto& stats = cache[name];
+        if (!stats) {
+            stats = &find(operations, name, "operation");
+        }
+        return *stats;
+    }
+
+    void dump(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        dumpSection(out, "Statements", statements);
+        dumpSection(out, "Operations", operations);
+    }
+
+    // f(stats) для каждой записи раздела; вызывается под мьютексом, долгой работы в f быть не должно
+    template<typename F>
+    void forEachStatement(F&& f) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& entry : statements) {
+            f(*entry.second);
+        }
+    }
+
+    template<typename F>
+    void forEachOperation(F&& f) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& entry : operations) {
+            f(*entry.second);
+        }
+    }
+
+    void dumpToFile(const std::string& path) {
+        std::ofstream out(path);
+        if (!out) {
+            throw std::runtime_error("Cannot open " + path + " for writing.");
+        }
+        dump(out);
+    }
+
+private:
+    using Table = std::unordered_map<std::string, std::unique_ptr<StatementStats>>;
+
+    StatementStats& find(Table& table, const std::string& key, const char* category) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return create(table, key, category);
+    }
+
+    // Вызывается под мьютексом
+    static StatementStats& create(Table& table, const std::string& key, const char* category) {
+        auto& stats = table[key];
+        if (!stats) {
+            stats = std::make_unique<StatementStats>();
+            stats->name = key;
+            stats->category = category;
+        }
+        return *stats;
+    }
+
+    static void dumpSection(std::ostream& out, const char* title, const Table& table) {
+        std::vector<const Table::value_type*> entries;
+        for (const auto& entry : table) {
+            entries.push_back(&entry);
+        }
+        std::sort(entries.begin(), entries.end(), [](const auto* a, const auto* b) { return a->first < b->first; });
+
+        out << title << " (latency in microseconds)\n";
+        out << std::left << std::setw(48) << "name" << std::right << std::setw(10) << "count" << std::setw(8) << "errors"
+            << std::setw(12) << "rows" << std::setw(14) << "bytes" << std::setw(10) << "p50" << std::setw(10) << "p99"
+            << std::setw(10) << "p999" << std::setw(10) << "max" << '\n';
+        for (const auto* entry : entries) {
+            const StatementStats& stats = *entry->second;
+            std::string name = entry->first.size() > 47 ? entry->first.substr(0, 44) + "..." : entry->first;
+            out << std::left << std::setw(48) << name << std::right << std::setw(10) << stats.latency.count()
+                << std::setw(8) << stats.errors.load() << std::setw(12) << stats.rows.load() << std::setw(14)
+                << stats.bytes.load() << std::setw(10) << stats.latency.percentile(0.5) << std::setw(10)
+                << stats.latency.percentile(0.99) << std::setw(10) << stats.latency.percentile(0.999) << std::setw(10)
+                << stats.latency.max() << '\n';
+        }
+        out << '\n';
+    }
+
+    static constexpr size_t maxAdhocKeys = 256;
+
+    std::mutex mutex;
+    Table statements;
+    Table operations;
+    size_t adhocKeys = 0;
+};
+
+// Объём данных результата: сумма длин полей (без накладных расходов libpq на строку)
+inline size_t resultBytes(const pqxx::result& res) {
+    size_t bytes = 0;
+    for (const auto& row : res) {
+        for (const auto& field : row) {
+            bytes += field.size();
+        }
+    }
+    return bytes;
+}
+
+// Как вызов попадает в трассу: синхронный интервал потока или асинхронный (корутины цикла событий)
+enum class SpanKind { Sync, Async };
+
+// Замер одного вызова: задержка записывается в деструкторе, а при включённой трассировке вызов
+// попадает в неё интервалом. Вызов считается ошибочным, если объект разрушается при раскрутке
+// стека или был вызван fail()
+class LatencyTimer {
+public:
+    explicit LatencyTimer(StatementStats& stats, SpanKind kind = SpanKind::Sync)
+        : stats(stats), kind(kind), started(std::chrono::steady_clock::now()),
+          exceptionsAtStart(std::uncaught_exceptions()) {}
+
+    LatencyTimer(const LatencyTimer&) = delete;
+    LatencyTimer& operator=(const LatencyTimer&) = delete;
+
+    ~LatencyTimer() {
+        auto duration = stopped.value_or(std::chrono::steady_clock::now()) - started;
+        stats.latency.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(duration).count()));
+        bool error = failed || std::uncaught_exceptions() > exceptionsAtStart;
+        if (error) {
+            stats.errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        TraceRecorder& recorder = TraceRecorder::global();
+        if (recorder.enabled()) {
+            if (kind == SpanKind::Async) {
+                recorder.completeAsync(stats.name, stats.category, started, duration, error);
+            } else {
+                recorder.complete(stats.name, stats.category, started, duration, error);
+            }
+        }
+    }
+
+    void fail() { failed = true; }
+
+    // Фиксирует длительность вызова; то, что выполняется после (журнал медленных запросов с EXPLAIN),
+    // в гистограмму и трассу не попадает. Ошибки по-прежнему учитываются в деструкторе
+    std::chrono::microseconds stop() {
+        if (!stopped) {
+            stopped = std::chrono::steady_clock::now();
+        }
+        return std::chrono::duration_cast<std::chrono::microseconds>(*stopped - started);
+    }
+
+    void result(size_t rows, size_t bytes) {
+        stats.rows.fetch_add(rows, std::memory_order_relaxed);
+        stats.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void result(const pqxx::result& res) { result(static_cast<size_t>(res.size()), resultBytes(res)); }
+
+    void result(const std::vector<std::vector<std::string>>& rows) {
+        size_t bytes = 0;
+        for (const auto& row : rows) {
+            for (const auto& field : row) {
+                bytes += field.size();
+            }
+        }
+        result(rows.size(), bytes);
+    }
+
+private:
+    StatementStats& stats;
+    SpanKind kind;
+    std::chrono::steady_clock::time_point started;
+    std::optional<std::chrono::steady_clock::time_point> stopped;
+    int exceptionsAtStart;
+    bool failed = false;
+};
+
+// Параметры запроса в журнале медленных запросов: $1=42, $2='pending', $3={1,2}
+inline void formatParam(std::ostream& out, std::string_view v) { out << '\'' << v << '\''; }
+inline void formatParam(std::ostream& out, const std::string& v) { formatParam(out, std::string_view(v)); }
+inline void formatParam(std::ostream& out, const char* v) { formatParam(out, std::string_view(v)); }
+inline void formatParam(std::ostream& out, bool v) { out << (v ? "true" : "false"); }
+
+template<typename V>
+    requires std::is_arithmetic_v<V>
+void formatParam(std::ostream& out, V v) {
+    out << v;
+}
+
+template<typename V>
+void formatParam(std::ostream& out, std::span<const V> v) {
+    out << '{';
+    for (size_t i = 0; i < v.size(); ++i) {
+        out << (i ? "," : "") << v[i];
+    }
+    out << '}';
+}
+
+template<typename V>
+void formatParam(std::ostream& out, const std::vector<V>& v) {
+    formatParam(out, std::span<const V>(v));
+}
+
+template<typename V>
+void formatParam(std::ostream& out, const std::optional<V>& v) {
+    if (v) {
+        formatParam(out, *v);
+    } else {
+        out << "NULL";
+    }
+}
+
+template<typename... Args>
+std::string formatParams(const Args&... args) {
+    std::ostringstream out;
+    int n = 0;
+    ((out << (n ? ", $" : "$") << n + 1 << '=', formatParam(out, args), ++n), ...);
+    return out.str();
+}
+
+inline std::string formatParams(const std::vector<std::string>& params) {
+    std::ostringstream out;
+    for (size_t i = 0; i < params.size(); ++i) {
+        out << (i ? ", $" : "$") << i + 1 << '=';
+        formatParam(out, params[i]);
+    }
+    return out.str();
+}
+
+// Настройки журнала медленных запросов
+struct SlowQueryOptions {
+    std::chrono::milliseconds threshold{200};            // Запрос дольше этого попадает в журнал
+    double explainSampleRate = 0.0;                      // Доля медленных запросов, которые перезапускаются под EXPLAIN
+    std::chrono::milliseconds explainTimeout{10000};     // statement_timeout перезапуска
+    std::string file = "slow_queries.txt";
+};
+
+// Журнал медленных запросов в отдельном файле (не в logs.txt): текст запроса, параметры, время и
+// план EXPLAIN (ANALYZE, BUFFERS), снятый повторным выполнением. Повтор идёт в транзакции, которая
+// затем откатывается, но это не бесплатно: запрос выполняется второй раз синхронно, INSERT/UPDATE/DELETE
+// снова берут блокировки строк, а значения последовательностей расходуются. Поэтому планы по умолчанию
+// не снимаются (explainSampleRate = 0), включать их стоит с малой долей. Пока enable() не вызван,
+// журнал выключен и стоит одной атомарной проверки на запрос
+class SlowQueryLog {
+public:
+    static SlowQueryLog& global() {
+        static SlowQueryLog log;
+        return log;
+    }
+
+    void enable(const SlowQueryOptions& newOptions) {
+        std::lock_guard<std::mutex> lock(mutex);
+        spdlog::drop("slow_queries");
+        logger = spdlog::basic_logger_mt("slow_queries", newOptions.file);
+        options = newOptions;
+        thresholdMicros = std::chrono::duration_cast<std::chrono::microseconds>(newOptions.threshold).count();
+    }
+
+    bool isSlow(std::chrono::microseconds elapsed) const {
+        int64_t threshold = thresholdMicros.load(std::memory_order_relaxed);
+        return threshold >= 0 && elapsed.count() >= threshold;
+    }
+
+    bool sampleExplain() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::uniform_real_distribution<double>(0.0, 1.0)(rng) < options.explainSampleRate;
+    }
+
+    std::chrono::milliseconds explainTimeout() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return options.explainTimeout;
+    }
+
+    void write(std::chrono::microseconds elapsed, const std::string& sql, const std::string& params, const std::string& plan) {
+        std::shared_ptr<spdlog::logger> target;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            target = logger;
+        }
+        if (!target) {
+            return;
+        }
+        target->warn("{} ms: {}\n  params: {}\n{}", elapsed.count() / 1000.0, sql, params.empty() ? "-" : params,
+                     plan.empty() ? "  plan: not captured" : plan);
+        target->flush();
+    }
+
+private:
+    std::mutex mutex;
+    std::shared_ptr<spdlog::logger> logger;
+    SlowQueryOptions options;
+    std::atomic<int64_t> thresholdMicros{-1};
+    std::mt19937_64 rng{std::random_device{}()};
+};
+
+// Ограничения размера результата одного запроса; 0 — без ограничения
+struct ResultLimits {
+    size_t maxRows = 0;
+    size_t maxBytes = 0;                                 // Сумма длин полей
+
+    bool any() const { return maxRows != 0 || maxBytes != 0; }
+};
+
+// Результат превысил ResultLimits или общий на процесс предел памяти результатов
+class ResultTooLarge : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Учёт памяти, которую держат результаты запросов: живые ResultView и результаты executeQuery, пока
+// они собираются (после возврата вектор принадлежит вызывающему и не учитывается). С setLimit
+// это общий на процесс предел: запрос, которому не хватило места, получает ResultTooLarge
+class ResultMemory {
+public:
+    // Учтённые байты одного результата; освобождаются в деструкторе
+    class Reservation {
+    public:
+        Reservation() = default;
+
+        Reservation(Reservation&& other) noexcept : bytes(std::exchange(other.bytes, 0)) {}
+
+        Reservation& operator=(Reservation&& other) noexcept {
+            if (this != &other) {
+                global().release(bytes);
+                bytes = std::exchange(other.bytes, 0);
+            }
+            return *this;
+        }
+
+        ~Reservation() { global().release(bytes); }
+
+        void grow(size_t more) {
+            global().add(more);
+            bytes += more;
+        }
+
+        size_t size() const { return bytes; }
+
+    private:
+        size_t bytes = 0;
+    };
+
+    static ResultMemory& global() {
+        static ResultMemory memory;
+        return memory;
+    }
+
+    void setLimit(size_t bytes) { limit.store(bytes, std::memory_order_relaxed); }
+
+    Reservation reserve(size_t bytes) {
+        Reservation reservation;
+        reservation.grow(bytes);
+        return reservation;
+    }
+
+    size_t held() const { return current.load(std::memory_order_relaxed); }
+    size_t peak() const { return highWater.load(std::memory_order_relaxed); }
+
+private:
+    void add(size_t bytes) {
+        size_t cap = limit.load(std::memory_order_relaxed);
+        size_t now = current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        if (cap != 0 && now > cap) {
+            current.fetch_sub(bytes, std::memory_order_relaxed);
+            throw ResultTooLarge("Query results would hold " + std::to_string(now) + " bytes, process limit is " +
+                                 std::to_string(cap) + ".");
+        }
+        size_t seen = highWater.load(std::memory_order_relaxed);
+        while (now > seen && !highWater.compare_exchange_weak(seen, now, std::memory_order_relaxed)) {
+        }
+    }
+
+    void release(size_t bytes) {
+        if (bytes != 0) {
+            current.fetch_sub(bytes, std::memory_order_relaxed);
+        }
+    }
+
+    std::atomic<size_t> current{0};
+    std::atomic<size_t> highWater{0};
+    std::atomic<size_t> limit{0};
+};
+
+// Проверка размера уже полученного результата
+inline void checkResultSize(size_t rows, size_t bytes, const ResultLimits& limits, const std::string& query) {
+    if (limits.maxRows != 0 && rows > limits.maxRows) {
+        throw ResultTooLarge("Query returned more than " + std::to_string(limits.maxRows) +
+                             " rows; use streamQuery() for large results: " + query);
+    }
+    if (limits.maxBytes != 0 && bytes > limits.maxBytes) {
+        throw ResultTooLarge("Query returned more than " + std::to_string(limits.maxBytes) +
+                             " bytes; use streamQuery() for large results: " + query);
+    }
+}
+
+// Экспорт метрик в текстовом формате Prometheus: файл переписывается раз в interval (запись во
+// временный файл и rename, чтобы читатель не увидел половину), его забирает textfile-коллектор
+// node_exporter или любой скрейпер на той же машине
+class MetricsExporter {
+public:
+    MetricsExporter(std::string path, std::chrono::seconds interval)
+        : path(std::move(path)), interval(interval), writer([this] { run(); }) {}
+
+    MetricsExporter(const MetricsExporter&) = delete;
+    MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+    ~MetricsExporter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        writer.join();
+    }
+
+    // Каждое семейство метрик выводится целиком подряд: HELP, TYPE и все его строки
+    static void render(std::ostream& out) {
+        out.precision(12);
+        std::vector<const StatementStats*> operations;
+        QueryMetrics::global().forEachOperation([&](const StatementStats& stats) { operations.push_back(&stats); });
+        std::vector<const StatementStats*> statements;
+        QueryMetrics::global().forEachStatement([&](const StatementStats& stats) { statements.push_back(&stats); });
+        auto pools = ConnectionPool::all();
+
+        family(out, "shop_operations_total", "counter", "Role operations.");
+        for (const auto* stats : operations) {
+            out << "shop_operations_total{" << operationLabels(stats->name) << "} " << stats->latency.count() << '\n';
+        }
+        family(out, "shop_operation_errors_total", "counter", "Role operations that failed.");
+        for (const auto* stats : operations) {
+            out << "shop_operation_errors_total{" << operationLabels(stats->name) << "} " << stats->errors.load() << '\n';
+        }
+
+        static constexpr uint64_t bounds[] = {1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+                                              1000000, 2500000, 5000000, 10000000};
+        family(out, "shop_statement_duration_seconds", "histogram", "Statement latency.");
+        for (const auto* stats : statements) {
+            std::string label = statementLabel(*stats);
+            for (uint64_t bound : bounds) {
+                out << "shop_statement_duration_seconds_bucket{" << label << ",le=\"" << bound / 1e6 << "\"} "
+                    << stats->latency.countAtOrBelow(bound) << '\n';
+            }
+            out << "shop_statement_duration_seconds_bucket{" << label << ",le=\"+Inf\"} " << stats->latency.count() << '\n';
+            out << "shop_statement_duration_seconds_sum{" << label << "} " << stats->latency.sum() / 1e6 << '\n';
+            out << "shop_statement_duration_seconds_count{" << label << "} " << stats->latency.count() << '\n';
+        }
+        family(out, "shop_statement_errors_total", "counter", "Statements that failed.");
+        for (const auto* stats : statements) {
+            out << "shop_statement_errors_total{" << statementLabel(*stats) << "} " << stats->errors.load() << '\n';
+        }
+        family(out, "shop_statement_rows_total", "counter", "Rows returned by statements.");
+        for (const auto* stats : statements) {
+            out << "shop_statement_rows_total{" << statementLabel(*stats) << "} " << stats->rows.load() << '\n';
+        }
+        family(out, "shop_statement_bytes_total", "counter", "Result bytes returned by statements.");
+        for (const auto* stats : statements) {
+            out << "shop_statement_bytes_total{" << statementLabel(*stats) << "} " << stats->bytes.load() << '\n';
+        }
+
+        family(out, "shop_pool_connections", "gauge", "Pooled connections by state.");
+        for (const auto& pool : pools) {
+            std::string label = poolLabel(*pool);
+            size_t open = pool->size();
+            size_t idle = pool->idleCount();
+            out << "shop_pool_connections{" << label << ",state=\"idle\"} " << idle << '\n';
+            out << "shop_pool_connections{" << label << ",state=\"in_use\"} " << open - std::min(open, idle) << '\n';
+        }
+        family(out, "shop_pool_acquire_total", "counter", "Connections handed out by the pool.");
+        for (const auto& pool : pools) {
+            out << "shop_pool_acquire_total{" << poolLabel(*pool) << "} " << pool->acquireCount() << '\n';
+        }
+        family(out, "shop_pool_acquire_wait_seconds_total", "counter", "Time spent waiting for a pooled connection.");
+        for (const auto& pool : pools) {
+            out << "shop_pool_acquire_wait_seconds_total{" << poolLabel(*pool) << "} " << pool->totalWait().count() / 1e6
+                << '\n';
+        }
+        family(out, "shop_pool_acquire_timeouts_total", "counter", "Pool acquisitions that timed out.");
+        for (const auto& pool : pools) {
+            out << "shop_pool_acquire_timeouts_total{" << poolLabel(*pool) << "} " << pool->acquireTimeoutCount() << '\n';
+        }
+
+        family(out, "shop_errors_total", "counter", "Database errors by SQLSTATE.");
+        for (const auto& [sqlstate, count] : ErrorCounters::global().snapshot()) {
+            out << "shop_errors_total{sqlstate=\"" << escapeLabel(sqlstate) << "\"} " << count << '\n';
+        }
+
+        family(out, "shop_statement_cache_hits_total", "counter", "Prepared statement cache hits.");
+        out << "shop_statement_cache_hits_total " << StatementCache::totalHits().load() << '\n';
+        family(out, "shop_statement_cache_misses_total", "counter", "Prepared statement cache misses.");
+        out << "shop_statement_cache_misses_total " << StatementCache::totalMisses().load() << '\n';
+
+        family(out, "shop_result_memory_bytes", "gauge", "Bytes held by live query results.");
+        out << "shop_result_memory_bytes " << ResultMemory::global().held() << '\n';
+        family(out, "shop_result_memory_peak_bytes", "gauge", "Peak bytes held by query results.");
+        out << "shop_result_memory_peak_bytes " << ResultMemory::global().peak() << '\n';
+    }
+
+    void writeNow() {
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            if (!out) {
+                throw std::runtime_error("Cannot open " + tmp + " for writing.");
+            }
+            render(out);
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Cannot replace " + path + ".");
+        }
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            lock.unlock();
+            try {
+                writeNow();
+            } catch (const std::exception& e) {
+                spdlog::warn("Failed to export metrics: {}", e.what());
+            }
+            lock.lock();
+            if (stopping || cv.wait_for(lock, interval, [&] { return stopping; })) {
+                return;
+            }
+        }
+    }
+
+    static void family(std::ostream& out, const char* name, const char* type, const char* help) {
+        out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+    }
+
+    static std::string statementLabel(const StatementStats& stats) {
+        return "statement=\"" + escapeLabel(stats.name) + "\"";
+    }
+
+    static std::string poolLabel(const ConnectionPool& pool) {
+        return "pool=\"" + escapeLabel(poolName(pool.connectionString())) + "\"";
+    }
+
+    // "Admin.cancelOrder.async" -> role="Admin",operation="cancelOrder",mode="async"
+    static std::string operationLabels(const std::string& name) {
+        std::string_view rest = name;
+        std::string_view mode = "sync";
+        if (rest.size() > 6 && rest.substr(rest.size() - 6) == ".async") {
+            rest.remove_suffix(6);
+            mode = "async";
+        }
+        size_t dot = rest.find('.');
+        std::string_view role = dot == std::string_view::npos ? std::string_view{} : rest.substr(0, dot);
+        std::string_view operation = dot == std::string_view::npos ? rest : rest.substr(dot + 1);
+        return "role=\"" + escapeLabel(role) + "\",operation=\"" + escapeLabel(operation) + "\",mode=\"" +
+               std::string(mode) + "\"";
+    }
+
+    // Строка подключения без пароля
+    static std::string poolName(const std::string& connStr) {
+        std::istringstream in(connStr);
+        std::string name;
+        std::string token;
+        while (in >> token) {
+            if (token.rfind("password=", 0) == 0) {
+                continue;
+            }
+            name += (name.empty() ? "" : " ") + token;
+        }
+        return name;
+    }
+
+    static std::string escapeLabel(std::string_view value) {
+        std::string escaped;
+        escaped.reserve(value.size());
+        for (char c : value) {
+            if (c == '\\' || c == '"') {
+                escaped += '\\';
+                escaped += c;
+            } else if (c == '\n') {
+                escaped += "\\n";
+            } else {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    std::string path;
+    std::chrono::seconds interval;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::thread writer;
+};
+
+// Настройки пула по умолчанию: каждое новое соединение сразу получает запросы реестра
+inline PoolOptions defaultPoolOptions() {
+    PoolOptions options;
+    options.onConnect = prepareQueries;
+    return options;
+}
+
+// Настройки маршрутизации чтения на реплики
+struct ReplicaOptions {
+    std::chrono::milliseconds maxLag{1000};              // Реплика, отстающая сильнее, запросов не получает
+    std::chrono::milliseconds checkInterval{1000};       // Как часто перемеривать отставание и пробовать упавшие реплики
+    PoolOptions pool = defaultPoolOptions();
+};
+
+// Реплики одного основного сервера. Чтение уходит на наименее загруженную реплику с допустимым
+// отставанием; если такой нет, вызывающий читает с основного сервера. Отставание меряется
+// на взятом соединении не чаще раза в checkInterval, отдельного потока для этого нет
+class ReplicaSet {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Stats {
+        std::string connStr;
+        uint64_t queries;
+        size_t inFlight;
+        std::chrono::milliseconds lag;
+        bool healthy;
+    };
+
+private:
+    struct Replica {
+        std::string connStr;
+        std::shared_ptr<ConnectionPool> pool;
+        std::atomic<uint64_t> queries{0};
+        std::atomic<size_t> inFlight{0};
+        std::atomic<int64_t> lagMs{0};
+        std::atomic<int64_t> checkedAt{0};   // Clock::time_point в миллисекундах с начала эпохи часов
+    };
+
+public:
+    // RAII-дескриптор соединения реплики; учитывает запросы "в полёте" для выбора реплики
+    class ReadLease {
+    public:
+        ReadLease() = default;
+        ReadLease(Replica* replica, ConnectionPool::Lease lease) : replica(replica), conn(std::move(lease)) {}
+
+        ReadLease(ReadLease&& other) noexcept
+            : replica(std::exchange(other.replica, nullptr)), conn(std::move(other.conn)) {}
+
+        ReadLease& operator=(ReadLease&&) = delete;
+
+        ~ReadLease() {
+            if (replica) {
+                --replica->inFlight;
+            }
+        }
+
+        explicit operator bool() const { return replica != nullptr; }
+        ConnectionPool::Lease& lease() { return conn; }
+
+    private:
+        Replica* replica = nullptr;
+        ConnectionPool::Lease conn;
+    };
+
+    ReplicaSet(const std::vector<std::string>& replicaConnStrs, ReplicaOptions options) : options(std::move(options)) {
+        for (const auto& connStr : replicaConnStrs) {
+            auto replica = std::make_unique<Replica>();
+            replica->connStr = connStr;
+            replicas.push_back(std::move(replica));
+        }
+    }
+
+    // Подключение реплик к основному серверу; DatabaseConnection подхватывает их по строке подключения
+    static void configure(const std::string& primaryConnStr, const std::vector<std::string>& replicaConnStrs,
+                          ReplicaOptions options = {}) {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        registry()[primaryConnStr] = std::make_shared<ReplicaSet>(replicaConnStrs, std::move(options));
+    }
+
+    static std::shared_ptr<ReplicaSet> forPrimary(const std::string& primaryConnStr) {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        auto it = registry().find(primaryConnStr);
+        return it == registry().end() ? nullptr : it->second;
+    }
+
+    // Пустой ReadLease означает "читать с основного сервера". Реплика, которая не выдала соединение
+    // или оказалась отстающей при проверке, пропускается, и берётся следующая
+    ReadLease acquire() {
+        auto now = nowMs();
+        std::vector<const Replica*> tried;
+        while (true) {
+            Replica* best = nullptr;
+            std::shared_ptr<ConnectionPool> bestPool;
+            bool created = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto& replica : replicas) {
+                    if (std::find(tried.begin(), tried.end(), replica.get()) != tried.end()) {
+                        continue;
+                    }
+                    bool due = now - replica->checkedAt >= options.checkInterval.count();
+                    if (!replica->pool && !due) {
+                        continue;
+                    }
+                    if (replica->lagMs > options.maxLag.count() && !due) {
+                        continue;
+                    }
+                    if (!best || replica->inFlight < best->inFlight) {
+                        best = replica.get();
+                    }
+                }
+                if (!best) {
+                    ++fallbacks;
+                    return {};
+                }
+                if (!best->pool) {
+                    best->pool = std::make_shared<ConnectionPool>(best->connStr, options.pool);
+                    best->pool->warmUpAsync();
+                    created = true;
+                }
+                bestPool = best->pool;
+                ++best->inFlight;
+            }
+            tried.push_back(best);
+
+            ConnectionPool::Lease lease;
+            try {
+                lease = bestPool->acquire();
+            } catch (const std::exception& e) {
+                spdlog::warn("Replica {} unavailable: {}", best->connStr, e.what());
+                --best->inFlight;
+                markLagging(*best, now);
+                continue;
+            }
+            ReadLease read(best, std::move(lease));
+
+            // Новую реплику проверяем сразу: до первого замера её отставание неизвестно
+            bool due = created || now - best->checkedAt >= options.checkInterval.count();
+            if (due && !measureLag(*best, *read.lease(), now)) {
+                continue;
+            }
+
+            ++best->queries;
+            return read;
+        }
+    }
+
+    uint64_t fallbackCount() const { return fallbacks; }
+
+    std::vector<Stats> stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<Stats> result;
+        for (const auto& replica : replicas) {
+            result.push_back({replica->connStr, replica->queries, replica->inFlight,
+                              std::chrono::milliseconds(replica->lagMs),
+                              replica->pool && replica->lagMs <= options.maxLag.count()});
+        }
+        return result;
+    }
+
+private:
+    static int64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    // Отставание в миллисекундах; реплика, догнавшая основной сервер, отстаёт на 0, даже если
+    // на основном давно не было записей
+    bool measureLag(Replica& replica, pqxx::connection& conn, int64_t now) {
+        replica.checkedAt = now;
+        try {
+            pqxx::nontransaction ntx(conn);
+            auto res = ntx.exec(
+                "SELECT CASE WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0 "
+                "ELSE COALESCE(EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp()) * 1000, 0) END::bigint");
+            replica.lagMs = res[0][0].as<int64_t>();
+        } catch (const std::exception& e) {
+            spdlog::warn("Failed to measure lag of replica {}: {}", replica.connStr, e.what());
+            replica.lagMs = std::numeric_limits<int64_t>::max();
+        }
+        if (replica.lagMs > options.maxLag.count()) {
+            spdlog::warn("Replica {} lags {} ms, reading from primary.", replica.connStr, replica.lagMs.load());
+            return false;
+        }
+        return true;
+    }
+
+    void markLagging(Replica& replica, int64_t now) {
+        replica.checkedAt = now;
+        replica.lagMs = std::numeric_limits<int64_t>::max();
+    }
+
+    static std::mutex& registryMutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::unordered_map<std::string, std::shared_ptr<ReplicaSet>>& registry() {
+        static std::unordered_map<std::string, std::shared_ptr<ReplicaSet>> r;
+        return r;
+    }
+
+    ReplicaOptions options;
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<Replica>> replicas;
+    std::atomic<uint64_t> fallbacks{0};
+};
+
+// Итог пакетного выполнения: сколько элементов прошло и какие отвергнуты (индекс во входных данных)
+struct BatchReport {
+    struct ItemError {
+        size_t index;
+        std::string message;
+    };
+
+    size_t succeeded = 0;
+    std::vector<ItemError> failed;
+};
+
+// Настройки пакетного выполнения с точками сохранения
+struct BatchOptions {
+    size_t initialChunk = 64;   // Элементов под одной точкой сохранения в начале
+    size_t maxChunk = 1024;     // Чистая пачка удваивает размер следующей, но не выше этого
+};
+
+// Настройки группового коммита
+struct CoalescerOptions {
+    size_t maxBatch = 64;                                // Сброс, как только накопилось столько записей
+    std::chrono::milliseconds maxDelay{5};               // ... или первая запись в пачке ждёт столько
+};
+
+// Групповой коммит мелких записей: запросы многих потоков собираются в одну транзакцию, и на
+// пачку приходится один COMMIT (один fsync на сервере) вместо одного на запрос. Каждый вызывающий
+// получает свой результат: если запрос пачки падает, он исключается и пачка выполняется заново
+// без него, так что ошибка одного не откатывает чужие записи
+class WriteCoalescer {
+public:
+    WriteCoalescer(std::shared_ptr<ConnectionPool> pool, CoalescerOptions options)
+        : pool(std::move(pool)), options(options), flusher([this] { run(); }) {}
+
+    WriteCoalescer(const WriteCoalescer&) = delete;
+    WriteCoalescer& operator=(const WriteCoalescer&) = delete;
+
+    ~WriteCoalescer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        flusher.join();
+    }
+
+    // Включение группового коммита для строки подключения; DatabaseConnection подхватывает его
+    // в executeNonQuery и execute по запросам реестра вне области транзакции
+    static void enable(const std::string& connStr, CoalescerOptions options = {}) {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        registry()[connStr] = std::make_shared<WriteCoalescer>(ConnectionPool::shared(connStr, defaultPoolOptions()), options);
+    }
+
+    static std::shared_ptr<WriteCoalescer> forConnString(const std::string& connStr) {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        auto it = registry().find(connStr);
+        return it == registry().end() ? nullptr : it->second;
+    }
+
+    std::future<void> submit(std::string query, const std::vector<std::string>& params) {
+        return enqueue(Pending{std::move(query), nullptr, toParams(params), {}});
+    }
+
+    // Запрос реестра: уже подготовлен на каждом соединении пула, выполняется по имени
+    template<typename... Params>
+    std::future<void> submit(const StatementDef<Params...>& stmt, pqxx::params params) {
+        return enqueue(Pending{stmt.sql, stmt.name, std::move(params), {}});
+    }
+
+private:
+    struct Pending {
+        std::string query;
+        const char* registered;  // Имя запроса реестра или nullptr для произвольного SQL
+        pqxx::params params;
+        std::promise<void> done;
+        bool reprepared = false;  // Повтор после потери подготовленного запроса уже был
+    };
+
+    std::future<void> enqueue(Pending pending) {
+        auto result = pending.done.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (queue.empty()) {
+                firstQueuedAt = std::chrono::steady_clock::now();
+            }
+            queue.push_back(std::move(pending));
+        }
+        cv.notify_one();
+        return result;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [&] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            cv.wait_until(lock, firstQueuedAt + options.maxDelay,
+                          [&] { return stopping || queue.size() >= options.maxBatch; });
+
+            std::vector<Pending> batch;
+            size_t count = std::min(queue.size(), options.maxBatch);
+            batch.reserve(count);
+            for (size_t i = 0; i < count; ++i) {
+                batch.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            if (!queue.empty()) {
+                firstQueuedAt = std::chrono::steady_clock::now();
+            }
+
+            lock.unlock();
+            flush(batch);
+            lock.lock();
+        }
+    }
+
+    // Выполнение пачки одной транзакцией; упавший запрос получает свою ошибку, остальные повторяются
+    void flush(std::vector<Pending>& batch) {
+        std::vector<Pending*> remaining;
+        for (auto& pending : batch) {
+            remaining.push_back(&pending);
+        }
+
+        while (!remaining.empty()) {
+            size_t failed = remaining.size();
+            try {
+                if (!lease || !lease->is_open()) {
+                    if (lease) {
+                        lease.markBroken();
+                    }
+                    lease = pool->acquire();
+                }
+
+                std::vector<std::string> names;
+                names.reserve(remaining.size());
+                for (size_t i = 0; i < remaining.size(); ++i) {
+                    failed = i;
+                    names.push_back(remaining[i]->registered ? std::string(remaining[i]->registered)
+                                                             : lease.statements().prepare(*lease, remaining[i]->query));
+                }
+
+                pqxx::work work(*lease);
+                for (size_t i = 0; i < remaining.size(); ++i) {
+                    failed = i;
+                    work.exec_prepared(names[i], remaining[i]->params);
+                }
+                failed = remaining.size();
+                work.commit();
+
+                for (auto* pending : remaining) {
+                    pending->done.set_value();
+                }
+                return;
+            } catch (const std::exception& e) {
+                if (failed == remaining.size()) {
+                    // Сбой соединения или COMMIT: исход общий для всей пачки
+                    spdlog::error("Group commit of {} writes failed: {}", remaining.size(), e.what());
+                    for (auto* pending : remaining) {
+                        pending->done.set_exception(std::current_exception());
+                    }
+                    return;
+                }
+                const auto* sql = dynamic_cast<const pqxx::sql_error*>(&e);
+                if (sql && sql->sqlstate() == "26000" && !remaining[failed]->reprepared) {
+                    // Сервер потерял подготовленный запрос: готовим заново и повторяем пачку, как withPrepared
+                    remaining[failed]->reprepared = true;
+                    lease.statements().clear();
+                    if (remaining[failed]->registered) {
+                        try {
+                            prepareQueries(*lease);
+                        } catch (const std::exception& prepareError) {
+                            spdlog::warn("Failed to re-prepare registered statements: {}", prepareError.what());
+                        }
+                    }
+                    continue;
+                }
+                remaining[failed]->done.set_exception(std::current_exception());
+                remaining.erase(remaining.begin() + static_cast<std::ptrdiff_t>(failed));
+            }
+        }
+    }
+
+    static std::mutex& registryMutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::unordered_map<std::string, std::shared_ptr<WriteCoalescer>>& registry() {
+        static std::unordered_map<std::string, std::shared_ptr<WriteCoalescer>> r;
+        return r;
+    }
+
+    std::shared_ptr<ConnectionPool> pool;
+    CoalescerOptions options;
+    ConnectionPool::Lease lease;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Pending> queue;
+    std::chrono::steady_clock::time_point firstQueuedAt;
+    bool stopping = false;
+    std::thread flusher;  // Последним: поток стартует, когда остальные поля уже созданы
+};
+
+// Допустимые типы столбца PostgreSQL (OID из pg_type) для C++-типа поля.
+// Для незнакомых типов проверка не делается, разбор всё равно выполнит pqxx
+template<typename V>
+struct PgColumnType {
+    static bool accepts(pqxx::oid) { return true; }
+};
+
+template<>
+struct PgColumnType<int> {
+    static bool accepts(pqxx::oid oid) { return oid == 21 || oid == 23; }  // int2, int4
+};
+
+template<>
+struct PgColumnType<long long> {
+    static bool accepts(pqxx::oid oid) { return oid == 20 || oid == 21 || oid == 23; }  // int8, int2, int4
+};
+
+template<>
+struct PgColumnType<long> : PgColumnType<long long> {};
+
+template<>
+struct PgColumnType<double> {
+    static bool accepts(pqxx::oid oid) { return oid == 700 || oid == 701 || oid == 1700; }  // float4, float8, numeric
+};
+
+template<>
+struct PgColumnType<bool> {
+    static bool accepts(pqxx::oid oid) { return oid == 16; }
+};
+
+template<>
+struct PgColumnType<std::string> {
+    static bool accepts(pqxx::oid oid) { return oid == 25 || oid == 1043 || oid == 1042 || oid == 19; }  // text, varchar, bpchar, name
+};
+
+template<typename V>
+struct PgColumnType<std::optional<V>> : PgColumnType<V> {};
+
+// Набор столбцов строки: кортеж описывает себя сам, структура — через typedef Columns
+template<typename Row>
+struct RowColumns {
+    using type = typename Row::Columns;
+};
+
+template<typename... Cs>
+struct RowColumns<std::tuple<Cs...>> {
+    using type = std::tuple<Cs...>;
+};
+
+template<typename Columns, size_t... I>
+Columns decodeColumns(const pqxx::row& row, std::index_sequence<I...>) {
+    return Columns(row[static_cast<int>(I)].template as<std::tuple_element_t<I, Columns>>()...);
+}
+
+// Разбор строки в Row без промежуточных std::string
+template<typename Row>
+Row decodeRow(const pqxx::row& row) {
+    using Columns = typename RowColumns<Row>::type;
+    return std::make_from_tuple<Row>(decodeColumns<Columns>(row, std::make_index_sequence<std::tuple_size_v<Columns>>{}));
+}
+
+template<typename Columns, size_t... I>
+bool columnTypesMatch(const pqxx::result& res, std::index_sequence<I...>) {
+    return (PgColumnType<std::tuple_element_t<I, Columns>>::accepts(res.column_type(static_cast<int>(I))) && ...);
+}
+
+// Сверка результата с Row: расхождение схемы и кода обнаруживается сразу, а не на разборе поля
+template<typename Row>
+void checkColumns(const pqxx::result& res, const std::string& query) {
+    using Columns = typename RowColumns<Row>::type;
+    constexpr size_t count = std::tuple_size_v<Columns>;
+    if (static_cast<size_t>(res.columns()) != count) {
+        throw std::runtime_error("Query returns " + std::to_string(res.columns()) + " columns, row type expects " +
+                                 std::to_string(count) + ": " + query);
+    }
+    if (!columnTypesMatch<Columns>(res, std::make_index_sequence<count>{})) {
+        throw std::runtime_error("Column types do not match row type: " + query);
+    }
+}
+
+// Результат запроса без копирования полей: владеет pqxx::result и отдаёт поля как
+// std::string_view или сразу нужного типа. Представления живут, пока жив сам ResultView
+class ResultView {
+public:
+    class RowView {
+    public:
+        RowView(const pqxx::result* res, int row) : res(res), row(row) {}
+
+        std::string_view operator[](int col) const { return (*res)[row][col].view(); }
+
+        template<typename V>
+        V get(int col) const { return (*res)[row][col].template as<V>(); }
+
+        bool isNull(int col) const { return (*res)[row][col].is_null(); }
+        int size() const { return res->columns(); }
+
+    private:
+        const pqxx::result* res;
+        int row;
+    };
+
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = RowView;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = RowView;
+
+        iterator(const pqxx::result* res, int row) : res(res), row(row) {}
+
+        RowView operator*() const { return RowView(res, row); }
+
+        iterator& operator++() {
+            ++row;
+            return *this;
+        }
+
+        bool operator==(const iterator& other) const { return row == other.row; }
+        bool operator!=(const iterator& other) const { return row != other.row; }
+
+    private:
+        const pqxx::result* res;
+        int row;
+    };
+
+    ResultView() = default;
+    explicit ResultView(pqxx::result result) : res(std::move(result)), held(ResultMemory::global().reserve(resultBytes(res))) {}
+
+    // bytes — уже посчитанный resultBytes(res); столько памяти учитывается за видом, пока он жив
+    ResultView(pqxx::result res, size_t bytes) : res(std::move(res)), held(ResultMemory::global().reserve(bytes)) {}
+
+    size_t size() const { return static_cast<size_t>(res.size()); }
+    bool empty() const { return res.empty(); }
+    int columns() const { return res.columns(); }
+
+    RowView operator[](size_t row) const { return RowView(&res, static_cast<int>(row)); }
+
+    iterator begin() const { return iterator(&res, 0); }
+    iterator end() const { return iterator(&res, res.size()); }
+
+private:
+    pqxx::result res;
+    ResultMemory::Reservation held;
+};
+
+// Потоковое чтение результата через серверный курсор: в памяти держится одна пачка из
+// fetchSize строк, сколько бы строк ни вернул запрос. Поток держит своё соединение из пула с открытой
+// читающей транзакцией и не мешает другим запросам DatabaseConnection; строка, полученная из
+// итератора, действительна до следующего ++
+class RowStream {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = pqxx::row;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const pqxx::row*;
+        using reference = const pqxx::row&;
+
+        iterator() = default;
+
+        explicit iterator(RowStream* stream) : stream(stream) {
+            if (!stream->fetchIfNeeded()) {
+                this->stream = nullptr;
+            }
+        }
+
+        pqxx::row operator*() const { return stream->batch[stream->pos]; }
+
+        iterator& operator++() {
+            ++stream->pos;
+            if (!stream->fetchIfNeeded()) {
+                stream = nullptr;
+            }
+            return *this;
+        }
+
+        bool operator==(const iterator& other) const { return stream == other.stream; }
+        bool operator!=(const iterator& other) const { return stream != other.stream; }
+
+    private:
+        RowStream* stream = nullptr;
+    };
+
+    RowStream(ConnectionPool::Lease lease, const std::string& query, const std::vector<std::string>& params,
+              size_t fetchSize)
+        : conn(std::move(lease)),
+          txn(std::make_unique<pqxx::read_transaction>(*conn)),
+          cursor(cursorName()),
+          fetchSize(std::max<size_t>(fetchSize, 1)) {
+        txn->exec_params("DECLARE " + cursor + " NO SCROLL CURSOR FOR " + query, toParams(params));
+    }
+
+    RowStream(const RowStream&) = delete;
+    RowStream& operator=(const RowStream&) = delete;
+
+    iterator begin() { return iterator(this); }
+    iterator end() { return iterator(); }
+
+private:
+    static std::string cursorName() {
+        static std::atomic<uint64_t> nextId{1};
+        return "row_stream_" + std::to_string(nextId++);
+    }
+
+    bool fetchIfNeeded() {
+        if (pos < static_cast<size_t>(batch.size())) {
+            return true;
+        }
+        if (exhausted) {
+            return false;
+        }
+        batch = txn->exec("FETCH " + std::to_string(fetchSize) + " FROM " + cursor);
+        pos = 0;
+        exhausted = static_cast<size_t>(batch.size()) < fetchSize;
+        return !batch.empty();
+    }
+
+    ConnectionPool::Lease conn;  // Перед txn: транзакция закрывается раньше, чем соединение уходит в пул
+    std::unique_ptr<pqxx::read_transaction> txn;
+    std::string cursor;
+    size_t fetchSize;
+    pqxx::result batch;
+    size_t pos = 0;
+    bool exhausted = false;
+};
+
+// Страница постраничной выборки. next — непрозрачный маркер продолжения для следующего вызова;
+// пустой, если страница последняя
+template<typename Row>
+struct Page {
+    std::vector<Row> rows;
+    std::string next;
+};
+
+// Маркер продолжения: ключ последней строки страницы. Вызывающему он непрозрачен, разбирает его
+// только executePage; версия в начале позволит поменять формат, не ломая выданные маркеры
+struct PageToken {
+    static std::string encode(int lastKey) {
+        static constexpr char digits[] = "0123456789abcdef";
+        std::string token = "k1";
+        auto bits = static_cast<uint32_t>(lastKey);
+        for (int shift = 28; shift >= 0; shift -= 4) {
+            token += digits[(bits >> shift) & 0xF];
+        }
+        return token;
+    }
+
+    // Пустой маркер означает первую страницу
+    static int decode(const std::string& token) {
+        if (token.empty()) {
+            return std::numeric_limits<int>::min();
+        }
+        if (token.size() != 10 || token.compare(0, 2, "k1") != 0) {
+            throw std::invalid_argument("Malformed page token: " + token);
+        }
+        uint32_t bits = 0;
+        for (size_t i = 2; i < token.size(); ++i) {
+            char c = token[i];
+            uint32_t digit;
+            if (c >= '0' && c <= '9') {
+                digit = c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                digit = c - 'a' + 10;
+            } else {
+                throw std::invalid_argument("Malformed page token: " + token);
+            }
+            bits = (bits << 4) | digit;
+        }
+        return static_cast<int>(bits);
+    }
+};
+
+template<typename T>
+class Task;
+
+// Общая часть promise для Task: запуск по co_await, по завершении управление
+// передаётся ожидающей корутине
+struct TaskPromiseBase {
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            return h.promise().continuation;
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+};
+
+template<typename T>
+struct TaskPromise : TaskPromiseBase {
+    Task<T> get_return_object();
+
+    template<typename U>
+    void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+
+    T take() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*value);
+    }
+
+    std::optional<T> value;
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+
+    void return_void() {}
+
+    void take() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+// Ленивая корутина с результатом T. Начинает выполняться при co_await,
+// исключения пробрасываются ожидающему
+template<typename T = void>
+class Task {
+public:
+    using promise_type = TaskPromise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+            handle = std::exchange(other.handle, {});
+        }
+        return *this;
+    }
+
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+
+    T await_resume() { return handle.promise().take(); }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+template<typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Корутина верхнего уровня, которая владеет собой сама
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() {
+            try {
+                throw;
+            } catch (const std::exception& e) {
+                spdlog::error("Unhandled error in spawned task: {}", e.what());
+            }
+        }
+    };
+};
+
+// Запуск задачи на цикле событий: выполняется до первого ожидания, дальше её ведёт EventLoop::run()
+inline DetachedTask spawn(Task<void> task) {
+    co_await task;
+}
+
+// Ожидание асинхронного запроса: start получает callback, который возобновит корутину
+struct QueryAwaiter {
+    explicit QueryAwaiter(std::function<void(AsyncQuery::Callback)> start) : start(std::move(start)) {}
+
+    std::function<void(AsyncQuery::Callback)> start;
+    StatementResult result;
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> h) {
+        start([this, h](StatementResult r) {
+            result = std::move(r);
+            h.resume();
+        });
+    }
+
+    StatementResult await_resume() { return std::move(result); }
+};
+
+// Шаблонный класс для работы с PostgreSQL
+template<typename T>
+class DatabaseConnection {
+public:
+    // Соединение берётся из пула при первом запросе, а не в конструкторе
+    DatabaseConnection(const std::string& connStr)
+        : pool(ConnectionPool::shared(connStr, defaultPoolOptions())),
+          replicas(ReplicaSet::forPrimary(connStr)),
+          coalescer(WriteCoalescer::forConnString(connStr)) {}
+
+    // Выполнение SQL-запроса с параметрами
+    std::vector<std::vector<std::string>> executeQuery(const std::string& query, const std::vector<std::string>& params = {}) {
+        return executeQuery(query, params, resultLimits);
+    }
+
+    // То же с ограничениями размера на этот вызов вместо ограничений соединения. Вне области
+    // транзакции ограниченный запрос читается по мере прихода строк, и превышение обнаруживается до
+    // того, как лишние строки окажутся в памяти; внутри области проверяется уже полученный результат
+    std::vector<std::vector<std::string>> executeQuery(const std::string& query, const std::vector<std::string>& params,
+                                                       const ResultLimits& limits) {
+        ResultMemory::Reservation held;
+        std::vector<std::vector<std::string>> result;
+
+        try {
+            LatencyTimer timer(QueryMetrics::global().adhoc(query));
+            if (limits.any() && !txn) {
+                result = fetchLimited(query, params, limits, held);
+                timer.result(result.size(), held.size());
+            } else {
+                pqxx::result res = routeRead([&](ConnectionPool::Lease& lease) {
+                    return withPrepared(lease, query, [&](pqxx::connection& c, const std::string& name) {
+                        return inReadScope(c, [&](pqxx::transaction_base& tx) {
+                            return tx.exec_prepared(name, toParams(params));
+                        });
+                    });
+                });
+                size_t bytes = resultBytes(res);
+                timer.result(static_cast<size_t>(res.size()), bytes);
+                checkResultSize(static_cast<size_t>(res.size()), bytes, limits, query);
+                // Пока строки копируются, в памяти и результат libpq, и копия
+                held.grow(2 * bytes);
+
+                result.reserve(res.size());
+                for (const auto& row : res) {
+                    std::vector<std::string> rowData;
+                    for (const auto& field : row) {
+                        rowData.push_back(field.c_str());
+                    }
+                    result.push_back(rowData);
+                }
+            }
+            logIfSlow(timer, query, params);
+        } catch (const std::exception& e) {
+            spdlog::error("Error executing query: {}", e.what());
+            throw;
+        }
+
+        return result;
+    }
+
+    // Типизированный вариант: каждая строка разбирается сразу в Row (std::tuple<...> или структуру
+    // с typedef Columns). Число и типы столбцов проверяются один раз на запрос
+    template<typename Row>
+    std::vector<Row> executeQuery(const std::string& query, const std::vector<std::string>& params = {}) {
+        try {
+            LatencyTimer timer(QueryMetrics::global().adhoc(query));
+            pqxx::result res = routeRead([&](ConnectionPool::Lease& lease) {
+                return withPrepared(lease, query, [&](pqxx::connection& c, const std::string& name) {
+                    return inReadScope(c, [&](pqxx::transaction_base& tx) {
+                        return tx.exec_prepared(name, toParams(params));
+                    });
+                });
+            });
+            size_t bytes = resultBytes(res);
+            timer.result(static_cast<size_t>(res.size()), bytes);
+            logIfSlow(timer, query, params);
+            checkResultSize(static_cast<size_t>(res.size()), bytes, resultLimits, query);
+            auto held = ResultMemory::global().reserve(bytes);
+
+            auto& checked = checkedRowTypes[std::type_index(typeid(Row))];
+            if (checked.find(query) == checked.end()) {
+                checkColumns<Row>(res, query);
+                checked.insert(query);
+            }
+
+            std::vector<Row> rows;
+            rows.reserve(res.size());
+            for (const auto& row : res) {
+                rows.push_back(decodeRow<Row>(row));
+            }
+            return rows;
+        } catch (const std::exception& e) {
+            spdlog::error("Error executing query: {}", e.what());
+            throw;
+        }
+    }
+
+    // То же, что executeQuery, но без копирования: одна аллокация на запрос вместо строки на поле
+    ResultView executeQueryView(const std::string& query, const std::vector<std::string>& params = {}) {
+        try {
+            LatencyTimer timer(QueryMetrics::global().adhoc(query));
+            pqxx::result res = routeRead([&](ConnectionPool::Lease& lease) {
+                return withPrepared(lease, query, [&](pqxx::connection& c, const std::string& name) {
+                    return inReadScope(c, [&](pqxx::transaction_base& tx) {
+                        return tx.exec_prepared(name, toParams(params));
+                    });
+                });
+            });
+            size_t bytes = resultBytes(res);
+            timer.result(static_cast<size_t>(res.size()), bytes);
+            logIfSlow(timer, query, params);
+            checkResultSize(static_cast<size_t>(res.size()), bytes, resultLimits, query);
+            return ResultView(std::move(res), bytes);
+        } catch (const std::exception& e) {
+            spdlog::error("Error executing query: {}", e.what());
+            throw;
+        }
+    }
+
+    // Выполнение SQL-запроса без возвращаемых данных
+    void executeNonQuery(const std::string& query, const std::vector<std::string>& params = {}) {
+        try {
+            LatencyTimer timer(QueryMetrics::global().adhoc(query));
+            // Обрыв до COMMIT откатывает транзакцию, обрыв во время COMMIT pqxx сообщает как in_doubt_error
+            withRetry(true, [&] {
+                if (coalescer && !txn && !statementDeadline()) {
+                    coalescer->submit(query, params).get();
+                    return;
+                }
+                session();
+                withPrepared(conn, query, [&](pqxx::connection& c, const std::string& name) {
+                    inWriteScope(c, [&](pqxx::transaction_base& tx) {
+                        tx.exec_prepared(name, toParams(params));
+                    });
+                });
+            });
+            logIfSlow(timer, query, params);
+        } catch (const std::exception& e) {
+            spdlog::error("Error executing non-query: {}", e.what());
+            throw;
+        }
+    }
+
+    // Пакет запросов одной транзакцией с точками сохранения: элемент, на котором сервер вернул ошибку
+    // (например, нарушение внешнего ключа), откатывается до точки сохранения и попадает в отчёт,
+    // остальные фиксируются одним COMMIT. Размер пачки под одной точкой сохранения подстраивается:
+    // растёт, пока ошибок нет, и уменьшается после ошибки
+    BatchReport executeBatch(const std::vector<Statement>& statements, const BatchOptions& options = {}) {
+        try {
+            session();
+            std::vector<std::string> names;
+            names.reserve(statements.size());
+            for (const auto& statement : statements) {
+                names.push_back(conn.statements().prepare(*conn, statement.sql));
+            }
+            return runBatch(statements.size(), options, [&](pqxx::transaction_base& tx, size_t i) {
+                tx.exec_prepared(names[i], toParams(statements[i].params));
+            });
+        } catch (const std::exception& e) {
+            spdlog::error("Error executing batch: {}", e.what());
+            throw;
+        }
+    }
+
+    // То же для запроса из реестра: по кортежу аргументов на элемент
+    template<typename... Params, typename... Args>
+    BatchReport executeBatch(const StatementDef<Params...>& stmt, const std::vector<std::tuple<Args...>>& rows,
+                             const BatchOptions& options = {}) {
+        static_assert(sizeof...(Params) == sizeof...(Args), "Wrong number of arguments for statement");
+        static_assert(StatementDef<Params...>::template accepts<Args...>(), "Argument type does not match statement parameter");
+
+        try {
+            session();
+            return runBatch(rows.size(), options, [&](pqxx::transaction_base& tx, size_t i) {
+                std::apply([&](const Args&... args) {
+                    tx.exec_prepared(stmt.name, static_cast<Params>(args)...);
+                }, rows[i]);
+            });
+        } catch (const std::exception& e) {
+            spdlog::error("Error executing batch of {}: {}", stmt.name, e.what());
+            throw;
+        }
+    }
+
+    // Выполнение запроса из реестра Queries. Число и типы аргументов проверяются при компиляции,
+    // параметры уходят в двоичном формате, а сам запрос подготовлен ещё при открытии соединения
+    template<typename... Params, typename... Args>
+    void execute(const StatementDef<Params...>& stmt, const Args&... args) {
+        static_assert(sizeof...(Params) == sizeof...(Args), "Wrong number of arguments for statement");
+        static_assert(StatementDef<Params...>::template accepts<Args...>(), "Argument type does not match statement parameter");
+
+        BinaryParams<sizeof...(Params)> params(static_cast<Params>(args)...);
+        try {
+            LatencyTimer timer(QueryMetrics::global().statement(stmt));
+            // Запрос выполняется в автокоммите: после обрыва неизвестно, зафиксирован ли он, не повторяем
+            withRetry(false, [&] {
+                if (coalescer && !txn && !statementDeadline()) {
+                    coalescer->submit(stmt, pqxx::params(static_cast<Params>(args)...)).get();
+                    return;
+                }
+                session();
+                withRegistered(conn, [&](pqxx::connection& c) {
+                    if (txn) {
+                        // Пока открыта транзакция pqxx, PGconn забирать нельзя: параметры уйдут текстом
+                        underDeadline(c, [&] { txn->exec_prepared(stmt.name, static_cast<Params>(args)...); });
+                        return;
+                    }
+                    RawConnection raw(c);
+                    underDeadline(raw.get(), [&] {
+                        PgResult res(PQexecPrepared(raw.get(), stmt.name, params.count(), params.values(), params.lengths(),
+                                                    params.formats(), 0),
+                                     &PQclear);
+                        throwIfFailed(res.get(), raw.get(), stmt.sql);
+                    });
+                });
+            });
+            logIfSlow(timer, stmt.sql, static_cast<Params>(args)...);
+        } catch (const std::exception& e) {
+            spdlog::error("Error executing {}: {}", stmt.name, e.what());
+            throw;
+        }
+    }
+
+    template<typename... Params, typename... Args>
+    ResultView executeQueryView(const StatementDef<Params...>& stmt, const Args&... args) {
+        static_assert(sizeof...(Params) == sizeof...(Args), "Wrong number of arguments for statement");
+        static_assert(StatementDef<Params...>::template accepts<Args...>(), "Argument type does not match statement parameter");
+
+        try {
+            LatencyTimer timer(QueryMetrics::global().statement(stmt));
+            pqxx::result res = routeRead([&](ConnectionPool::Lease& lease) {
+                return withRegistered(lease, [&](pqxx::connection& c) {
+                    return inReadScope(c, [&](pqxx::transaction_base& tx) {
+                        return tx.exec_prepared(stmt.name, static_cast<Params>(args)...);
+                    });
+                });
+            });
+            size_t bytes = resultBytes(res);
+            timer.result(static_cast<size_t>(res.size()), bytes);
+            logIfSlow(timer, stmt.sql, static_cast<Params>(args)...);
+            checkResultSize(static_cast<size_t>(res.size()), bytes, resultLimits, stmt.sql);
+            return ResultView(std::move(res), bytes);
+        } catch (const std::exception& e) {
+            spdlog::error("Error executing {}: {}", stmt.name, e.what());
+            throw;
+        }
+    }
+
+    // Типизированный вариант для запроса из реестра
+    template<typename Row, typename... Params, typename... Args>
+    std::vector<Row> executeQuery(const StatementDef<Params...>& stmt, const Args&... args) {
+        static_assert(sizeof...(Params) == sizeof...(Args), "Wrong number of arguments for statement");
+        static_assert(StatementDef<Params...>::template accepts<Args...>(), "Argument type does not match statement parameter");
+
+        try {
+            LatencyTimer timer(QueryMetrics::global().statement(stmt));
+            pqxx::result res = routeRead([&](ConnectionPool::Lease& lease) {
+                return withRegistered(lease, [&](pqxx::connection& c) {
+                    return inReadScope(c, [&](pqxx::transaction_base& tx) {
+                        return tx.exec_prepared(stmt.name, static_cast<Params>(args)...);
+                    });
+                });
+            });
+            size_t bytes = resultBytes(res);
+            timer.result(static_cast<size_t>(res.size()), bytes);
+            logIfSlow(timer, stmt.sql, static_cast<Params>(args)...);
+            checkResultSize(static_cast<size_t>(res.size()), bytes, resultLimits, stmt.sql);
+            auto held = ResultMemory::global().reserve(bytes);
+
+            auto& checked = checkedRowTypes[std::type_index(typeid(Row))];
+            if (checked.find(stmt.sql) == checked.end()) {
+                checkColumns<Row>(res, stmt.sql);
+                checked.insert(stmt.sql);
+            }
+
+            std::vector<Row> rows;
+            rows.reserve(res.size());
+            for (const auto& row : res) {
+                rows.push_back(decodeRow<Row>(row));
+            }
+            return rows;
+        } catch (const std::exception& e) {
+            spdlog::error("Error executing {}: {}", stmt.name, e.what());
+            throw;
+        }
+    }
+
+    // Страница выборки с пагинацией по ключу (keyset): запрос реестра продолжает с ключа, записанного
+    // в token, поэтому любая страница стоит одного прохода по индексу, как первая, сколько бы строк
+    // ни было до неё. Последние два параметра запроса — ключ и LIMIT, их подставляет executePage;
+    // args — остальные параметры. Ключ строки Row возвращает Row::key()
+    template<typename Row, typename... Params, typename... Args>
+    Page<Row> executePage(const StatementDef<Params...>& stmt, const std::string& token, int pageSize, const Args&... args) {
+        if (pageSize <= 0) {
+            throw std::invalid_argument("Page size must be positive.");
+        }
+        // Лишняя строка показывает, есть ли следующая страница, без отдельного запроса
+        Page<Row> page;
+        page.rows = executeQuery<Row>(stmt, args..., PageToken::decode(token), pageSize + 1);
+        if (page.rows.size() > static_cast<size_t>(pageSize)) {
+            page.rows.pop_back();
+            page.next = PageToken::encode(page.rows.back().key());
+        }
+        return page;
+    }
+
+    // Запрос без возвращаемых данных с параметрами в двоичном формате: без std::to_string и без
+    // строки на каждый параметр, сервер тоже не разбирает числа из текста
+    template<typename... Args>
+    void executeNonQueryTyped(const std::string& query, const Args&... args) {
+        BinaryParams<sizeof...(Args)> params(args...);
+        try {
+            LatencyTimer timer(QueryMetrics::global().adhoc(query));
+            withRetry(false, [&] {
+                if (txn) {
+                    underDeadline(*conn, [&] { txn->exec_params(query, args...); });
+                    return;
+                }
+                RawConnection raw(session());
+                underDeadline(raw.get(), [&] {
+                    PgResult res(PQexecParams(raw.get(), query.c_str(), params.count(), params.types(), params.values(),
+                                              params.lengths(), params.formats(), 0),
+                                 &PQclear);
+                    throwIfFailed(res.get(), raw.get(), query);
+                });
+            });
+            logIfSlow(timer, query, args...);
+        } catch (const std::exception& e) {
+            spdlog::error("Error executing non-query: {}", e.what());
+            throw;
+        }
+    }
+
+    // Выполнение пакета запросов в режиме pipeline libpq: все запросы отправляются без ожидания
+    // ответов, затем результаты собираются за один проход. Каждый запрос фиксируется отдельно
+    // (как при вызове executeNonQuery), поэтому ошибка одного не отменяет остальные
+    std::vector<StatementResult> executePipeline(const std::vector<Statement>& statements) {
+        if (statements.empty()) {
+            return {};
+        }
+        if (txn) {
+            throw std::logic_error("executePipeline() cannot run inside a transaction scope.");
+        }
+
+        try {
+            pqxx::connection& c = session();
+            std::vector<std::string> names;
+            names.reserve(statements.size());
+            for (const auto& statement : statements) {
+                names.push_back(conn.statements().prepare(c, statement.sql));
+            }
+
+            RawConnection raw(c);
+            return underDeadline(raw.get(), [&] {
+                sendPipeline(raw.get(), names, statements);
+                return collectPipeline(raw.get(), statements.size());
+            });
+        } catch (const std::exception& e) {
+            // Состояние протокола после сбоя посреди пакета неизвестно, соединение не переиспользуем
+            // Новое соединение возьмёт session() при следующем запросе: здесь acquire() мог бы ждать
+            // ещё acquireTimeout или подменить исходную ошибку своей
+            spdlog::error("Error executing pipeline: {}", e.what());
+            if (conn) {
+                conn.markBroken();
+                conn = {};
+            }
+            throw;
+        }
+    }
+
+    // Неблокирующие варианты: каждый запрос берёт своё соединение из пула и выполняется
+    // циклом loop, так что один поток держит в работе столько запросов, сколько позволяет пул.
+    // Если соединений не хватает, запрос ждёт в очереди пула, не блокируя цикл.
+    // Ошибки немедленной отправки выбрасываются сразу, остальные ошибки приходят в callback
+    void executeQueryAsync(EventLoop& loop, const std::string& query, const std::vector<std::string>& params,
+                           AsyncQuery::Callback callback) {
+        startAsync(loop, query, params, std::move(callback));
+    }
+
+    void executeNonQueryAsync(EventLoop& loop, const std::string& query, const std::vector<std::string>& params,
+                              AsyncQuery::Callback callback) {
+        startAsync(loop, query, params, std::move(callback));
+    }
+
+    // Корутинные варианты поверх executeQueryAsync: выполняются циклом loop и, как и
+    // синхронные, выбрасывают исключение при ошибке. Объект должен жить до завершения задачи
+    Task<std::vector<std::vector<std::string>>> executeQuery(EventLoop& loop, std::string query, std::vector<std::string> params = {}) {
+        LatencyTimer timer(QueryMetrics::global().adhoc(query), SpanKind::Async);
+        StatementResult result = co_await QueryAwaiter{[&](AsyncQuery::Callback callback) {
+            startAsync(loop, query, params, std::move(callback));
+        }};
+        timer.result(result.rows);
+        if (result.ok) {
+            logSlowAsync(timer, query, [&] { return formatParams(params); });
+        } else {
+            timer.fail();
+            ErrorCounters::global().record(result.sqlstate);
+            spdlog::error("Error executing query: {}", result.error);
+            throw std::runtime_error(result.error);
+        }
+        co_return std::move(result.rows);
+    }
+
+    Task<void> executeNonQuery(EventLoop& loop, std::string query, std::vector<std::string> params = {}) {
+        LatencyTimer timer(QueryMetrics::global().adhoc(query), SpanKind::Async);
+        StatementResult result = co_await QueryAwaiter{[&](AsyncQuery::Callback callback) {
+            startAsync(loop, query, params, std::move(callback));
+        }};
+        timer.result(result.rows);
+        if (result.ok) {
+            logSlowAsync(timer, query, [&] { return formatParams(params); });
+        } else {
+            timer.fail();
+            ErrorCounters::global().record(result.sqlstate);
+            spdlog::error("Error executing non-query: {}", result.error);
+            throw std::runtime_error(result.error);
+        }
+    }
+
+    // Потоковый вариант executeQuery для больших выборок: строки читаются пачками по fetchSize
+    RowStream streamQuery(const std::string& query, const std::vector<std::string>& params = {}, size_t fetchSize = 1000) {
+        try {
+            if (txn) {
+                throw std::logic_error("streamQuery() cannot run inside a transaction scope.");
+            }
+            return RowStream(pool->acquire(), query, params, fetchSize);
+        } catch (const std::exception& e) {
+            spdlog::error("Error opening row stream: {}", e.what());
+            throw;
+        }
+    }
+
+    // Загрузка строк через COPY ... FROM STDIN одной транзакцией (или в открытой области
+    // транзакции): все строки или ни одной
+    template<typename... Columns>
+    void copyRows(const std::string& table, std::initializer_list<std::string_view> columns,
+                  const std::vector<std::tuple<Columns...>>& rows) {
+        try {
+            inWriteScope(session(), [&](pqxx::transaction_base& tx) {
+                auto stream = pqxx::stream_to::table(tx, {table}, columns);
+                for (const auto& row : rows) {
+                    stream << row;
+                }
+                stream.complete();
+            });
+        } catch (const std::exception& e) {
+            spdlog::error("Error copying rows into {}: {}", table, e.what());
+            throw;
+        }
+    }
+
+    template<typename... Params, typename... Args>
+    Task<std::vector<std::vector<std::string>>> executeQuery(EventLoop& loop, const StatementDef<Params...>& stmt, Args... args) {
+        StatementResult result = co_await sendRegistered(loop, stmt, args...);
+        if (!result.ok) {
+            spdlog::error("Error executing {}: {}", stmt.name, result.error);
+            throw std::runtime_error(result.error);
+        }
+        co_return std::move(result.rows);
+    }
+
+    template<typename... Params, typename... Args>
+    Task<void> execute(EventLoop& loop, const StatementDef<Params...>& stmt, Args... args) {
+        StatementResult result = co_await sendRegistered(loop, stmt, args...);
+        if (!result.ok) {
+            spdlog::error("Error executing {}: {}", stmt.name, result.error);
+            throw std::runtime_error(result.error);
+        }
+    }
+
+    void setRetryPolicy(const RetryPolicy& policy) { retryPolicy = policy; }
+
+    // Ограничения размера результата для всех executeQuery и executeQueryView этого соединения;
+    // превышение даёт ResultTooLarge. Для больших выборок есть streamQuery
+    void setResultLimits(const ResultLimits& limits) { resultLimits = limits; }
+
+    // Срок на каждый запрос к серверу; нулевой отключает ограничение. Не успевший запрос
+    // отменяется через PQcancel, вызывающий получает DeadlineExceeded
+    void setCallTimeout(std::chrono::milliseconds timeout) { callTimeout = timeout; }
+
+    // Срок на всю операцию: пока объект жив, все запросы этого соединения, включая повторы,
+    // должны завершиться до истечения timeout. Вложенная область не продлевает внешнюю
+    class DeadlineScope {
+    public:
+        DeadlineScope(DatabaseConnection& db, std::chrono::milliseconds timeout)
+            : db(db), previous(db.scopeDeadline) {
+            auto deadline = QueryWatchdog::Clock::now() + timeout;
+            db.scopeDeadline = previous ? std::min(*previous, deadline) : deadline;
+        }
+
+        DeadlineScope(const DeadlineScope&) = delete;
+        DeadlineScope& operator=(const DeadlineScope&) = delete;
+
+        ~DeadlineScope() { db.scopeDeadline = previous; }
+
+    private:
+        DatabaseConnection& db;
+        std::optional<QueryWatchdog::Clock::time_point> previous;
+    };
+
+    DeadlineScope deadline(std::chrono::milliseconds timeout) { return DeadlineScope(*this, timeout); }
+
+    // Статистика кеша подготовленных запросов текущего соединения
+    size_t statementCacheHits() const { return conn ? conn.statements().hits() : 0; }
+    size_t statementCacheMisses() const { return conn ? conn.statements().misses() : 0; }
+
+    // Работа с транзакциями
+    void beginTransaction() {
+        if (txn) {
+            throw std::logic_error("Transaction already in progress.");
+        }
+        txn = std::make_unique<pqxx::work>(session());
+    }
+
+    void commitTransaction() {
+        if (txn) {
+            auto finished = std::move(txn);
+            finished->commit();
+        }
+    }
+
+    void rollbackTransaction() {
+        if (txn) {
+            auto finished = std::move(txn);
+            finished->abort();
+        }
+    }
+
+    // Область транзакции: пока объект жив, executeQuery, executeNonQuery, execute и copyRows
+    // этого соединения выполняются в одной транзакции и фиксируются одним COMMIT.
+    // Без commit() транзакция откатывается в деструкторе. Повторы при временных ошибках внутри
+    // области не делаются: повторять нужно всю транзакцию целиком
+    class Transaction {
+    public:
+        explicit Transaction(DatabaseConnection& db) : db(db) { db.beginTransaction(); }
+
+        Transaction(const Transaction&) = delete;
+        Transaction& operator=(const Transaction&) = delete;
+
+        ~Transaction() {
+            if (!finished) {
+                try {
+                    db.rollbackTransaction();
+                } catch (const std::exception& e) {
+                    spdlog::error("Error rolling back transaction: {}", e.what());
+                }
+            }
+        }
+
+        void commit() {
+            finished = true;
+            db.commitTransaction();
+        }
+
+        void rollback() {
+            finished = true;
+            db.rollbackTransaction();
+        }
+
+    private:
+        DatabaseConnection& db;
+        bool finished = false;
+    };
+
+    Transaction transaction() { return Transaction(*this); }
+
+private:
+    // Соединение берётся из пула при первом обращении. Разорванное сервером заменяется новым;
+    // его кеш запросов пуст, поэтому запросы будут подготовлены заново при первом использовании
+    pqxx::connection& session() {
+        if (!conn) {
+            conn = pool->acquire();
+        } else if (!conn->is_open() && !txn) {
+            spdlog::warn("Connection lost, taking a fresh one from the pool.");
+            conn.markBroken();
+            conn = pool->acquire();
+        }
+        return *conn;
+    }
+
+    // Повтор f() при временных ошибках по retryPolicy. Обрыв соединения повторяется, только если
+    // retryOnDisconnect: запрос выполнялся в явной транзакции или ничего не менял. f должна сама
+    // брать соединение через session(), тогда повтор идёт уже на новом соединении
+    template<typename F>
+    auto withRetry(bool retryOnDisconnect, F&& f) -> decltype(f()) {
+        if (txn) {
+            try {
+                return f();
+            } catch (const std::exception& e) {
+                ErrorCounters::global().record(e);
+                throw;
+            }
+        }
+        for (int attempt = 1;; ++attempt) {
+            try {
+                if constexpr (std::is_void_v<decltype(f())>) {
+                    f();
+                    RetryBudget::global().deposit();
+                    return;
+                } else {
+                    auto result = f();
+                    RetryBudget::global().deposit();
+                    return result;
+                }
+            } catch (const std::exception& e) {
+                ErrorCounters::global().record(e);
+                ErrorKind kind = classifyError(e);
+                bool retryable = kind == ErrorKind::Transient || (kind == ErrorKind::ConnectionLost && retryOnDisconnect);
+                auto delay = retryPolicy.delay(attempt);
+                if (!retryable || attempt >= retryPolicy.maxAttempts ||
+                    (scopeDeadline && QueryWatchdog::Clock::now() + delay >= *scopeDeadline) ||
+                    !RetryBudget::global().tryWithdraw()) {
+                    throw;
+                }
+                spdlog::warn("Transient error (attempt {}/{}), retrying in {} ms: {}",
+                             attempt, retryPolicy.maxAttempts, delay.count(), e.what());
+                std::this_thread::sleep_for(delay);
+            }
+        }
+    }
+
+    template<typename F>
+    BatchReport runBatch(size_t count, const BatchOptions& options, F&& execOne) {
+        BatchReport report;
+        auto deadline = statementDeadline();
+        inWriteScope(*conn, [&](pqxx::work& tx) {
+            size_t chunk = std::max<size_t>(options.initialChunk, 1);
+            for (size_t first = 0; first < count;) {
+                size_t n = std::min(chunk, count - first);
+                if (runChunk(tx, first, n, deadline, report, execOne)) {
+                    chunk = std::min(chunk * 2, std::max<size_t>(options.maxChunk, 1));
+                } else {
+                    chunk = std::max<size_t>(chunk / 2, 1);
+                }
+                first += n;
+            }
+        });
+        return report;
+    }
+
+    // Пачка под одной точкой сохранения; при ошибке пачка делится пополам, пока виноватые элементы
+    // не останутся по одному. Ошибки соединения не перехватываются: они губят всю транзакцию.
+    // Отмена (57014) и истёкший срок тоже прерывают всю пачку, а не записываются на элемент
+    template<typename F>
+    static bool runChunk(pqxx::work& tx, size_t first, size_t n,
+                         const std::optional<QueryWatchdog::Clock::time_point>& deadline, BatchReport& report,
+                         F& execOne) {
+        try {
+            pqxx::subtransaction savepoint(tx);
+            for (size_t i = first; i < first + n; ++i) {
+                // Отмена, пришедшая между запросами, сервер не прерывает: срок проверяется здесь
+                if (deadline && QueryWatchdog::Clock::now() >= *deadline) {
+                    throw DeadlineExceeded("Deadline expired in the middle of a batch.");
+                }
+                execOne(savepoint, i);
+            }
+            savepoint.commit();
+            report.succeeded += n;
+            return true;
+        } catch (const pqxx::sql_error& e) {
+            if (e.sqlstate() == "57014") {
+                throw;
+            }
+            if (n == 1) {
+                report.failed.push_back({first, e.what()});
+                return false;
+            }
+            size_t half = n / 2;
+            runChunk(tx, first, half, deadline, report, execOne);
+            runChunk(tx, first + half, n - half, deadline, report, execOne);
+            return false;
+        }
+    }
+
+    // Чтение с ограничениями тем же подготовленным запросом, что и без них, но строки libpq отдаёт
+    // по мере прихода (пачками или по одной). При превышении запрос отменяется на сервере, и в памяти
+    // не оказывается больше одной пачки сверх предела
+    std::vector<std::vector<std::string>> fetchLimited(const std::string& query, const std::vector<std::string>& params,
+                                                       const ResultLimits& limits, ResultMemory::Reservation& held) {
+        return routeRead([&](ConnectionPool::Lease& lease) {
+            held = ResultMemory::Reservation();  // Повтор после обрыва начинает учёт заново
+            return withPrepared(lease, query, [&](pqxx::connection& c, const std::string& name) {
+                RawConnection raw(c);
+                return underDeadline(raw.get(), [&] {
+                    return readIncrementally(raw.get(), name, query, params, limits, held);
+                });
+            });
+        });
+    }
+
+    static std::vector<std::vector<std::string>> readIncrementally(PGconn* pg, const std::string& name,
+                                                                   const std::string& query,
+                                                                   const std::vector<std::string>& params,
+                                                                   const ResultLimits& limits,
+                                                                   ResultMemory::Reservation& held) {
+        std::vector<const char*> values;
+        values.reserve(params.size());
+        for (const auto& param : params) {
+            values.push_back(param.c_str());
+        }
+        if (PQsendQueryPrepared(pg, name.c_str(), static_cast<int>(values.size()), values.data(), nullptr, nullptr, 0) != 1) {
+            throw pqxx::broken_connection(PQerrorMessage(pg));
+        }
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        size_t chunk = limits.maxRows != 0 ? std::min<size_t>(limits.maxRows + 1, 1000) : 1000;
+        bool incremental = PQsetChunkedRowsMode(pg, static_cast<int>(chunk)) == 1;
+#else
+        bool incremental = PQsetSingleRowMode(pg) == 1;
+#endif
+        if (!incremental) {
+            spdlog::warn("Row-by-row mode unavailable, reading the limited result at once: {}", query);
+        }
+
+        std::vector<std::vector<std::string>> rows;
+        size_t bytes = 0;
+        std::exception_ptr failure;
+        // Результаты вычитываются до nullptr и после ошибки: соединение должно вернуться в пул свободным
+        while (PGresult* next = PQgetResult(pg)) {
+            PgResult res(next, &PQclear);
+            if (failure) {
+                continue;
+            }
+            try {
+                if (!isRowBatch(PQresultStatus(res.get()))) {
+                    throwIfFailed(res.get(), pg, query);
+                }
+                for (auto& row : rowsOf(res.get())) {
+                    size_t rowBytes = 0;
+                    for (const auto& field : row) {
+                        rowBytes += field.size();
+                    }
+                    bytes += rowBytes;
+                    checkResultSize(rows.size() + 1, bytes, limits, query);
+                    held.grow(rowBytes);
+                    rows.push_back(std::move(row));
+                }
+            } catch (const ResultTooLarge&) {
+                failure = std::current_exception();
+                cancelRunning(pg);
+            } catch (...) {
+                failure = std::current_exception();
+            }
+        }
+        if (failure) {
+            std::rethrow_exception(failure);
+        }
+        return rows;
+    }
+
+    static bool isRowBatch(ExecStatusType status) {
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        return status == PGRES_SINGLE_TUPLE || status == PGRES_TUPLES_CHUNK;
+#else
+        return status == PGRES_SINGLE_TUPLE;
+#endif
+    }
+
+    // Отмена запроса, который больше не нужен; если она не удалась, остаток просто дочитывается
+    static void cancelRunning(PGconn* pg) {
+        std::unique_ptr<PGcancel, decltype(&PQfreeCancel)> handle(PQgetCancel(pg), &PQfreeCancel);
+        char error[256] = "PQgetCancel failed";
+        if (!handle || !PQcancel(handle.get(), error, sizeof(error))) {
+            spdlog::warn("Failed to cancel oversized query: {}", error);
+        }
+    }
+
+    // Запись в журнал медленных запросов, если вызов был медленным. Ошибки самого журнала
+    // и EXPLAIN не влияют на результат вызова
+    template<typename... Args>
+    void logIfSlow(LatencyTimer& timer, const std::string& sql, const Args&... args) {
+        SlowQueryLog& log = SlowQueryLog::global();
+        auto elapsed = timer.stop();
+        if (!log.isSlow(elapsed)) {
+            return;
+        }
+        try {
+            std::string plan;
+            if (log.sampleExplain()) {
+                plan = explain(sql, log.explainTimeout(), pqxx::params(args...));
+            }
+            log.write(elapsed, sql, formatParams(args...), plan);
+        } catch (const std::exception& e) {
+            spdlog::warn("Failed to log slow query: {}", e.what());
+        }
+    }
+
+    void logIfSlow(LatencyTimer& timer, const std::string& sql, const std::vector<std::string>& params) {
+        SlowQueryLog& log = SlowQueryLog::global();
+        auto elapsed = timer.stop();
+        if (!log.isSlow(elapsed)) {
+            return;
+        }
+        try {
+            std::string plan;
+            if (log.sampleExplain()) {
+                plan = explain(sql, log.explainTimeout(), toParams(params));
+            }
+            log.write(elapsed, sql, formatParams(params), plan);
+        } catch (const std::exception& e) {
+            spdlog::warn("Failed to log slow query: {}", e.what());
+        }
+    }
+
+    // Асинхронные вызовы попадают в журнал без плана: синхронный EXPLAIN остановил бы цикл событий
+    template<typename FormatParams>
+    static void logSlowAsync(LatencyTimer& timer, const std::string& sql, FormatParams&& formatted) {
+        SlowQueryLog& log = SlowQueryLog::global();
+        auto elapsed = timer.stop();
+        if (log.isSlow(elapsed)) {
+            log.write(elapsed, sql, formatted(), {});
+        }
+    }
+
+    // Повторное выполнение под EXPLAIN (ANALYZE, BUFFERS) на основном сервере в транзакции (или точке
+    // сохранения внутри открытой области транзакции), которая затем откатывается
+    std::string explain(const std::string& sql, std::chrono::milliseconds timeout, const pqxx::params& params) {
+        auto run = [&](pqxx::transaction_base& tx) {
+            tx.exec("SET LOCAL statement_timeout = " + std::to_string(timeout.count()));
+            std::string plan;
+            for (const auto& row : tx.exec_params("EXPLAIN (ANALYZE, BUFFERS) " + sql, params)) {
+                plan += "  ";
+                plan += row[0].view();
+                plan += '\n';
+            }
+            return plan;
+        };
+        try {
+            if (txn) {
+                pqxx::subtransaction savepoint(*txn);
+                std::string plan = run(savepoint);
+                savepoint.abort();
+                return plan;
+            }
+            pqxx::work work(session());
+            std::string plan = run(work);
+            work.abort();
+            return plan;
+        } catch (const std::exception& e) {
+            return std::string("  EXPLAIN failed: ") + e.what() + '\n';
+        }
+    }
+
+    // Ближайший из сроков: области операции и запроса
+    std::optional<QueryWatchdog::Clock::time_point> statementDeadline() const {
+        std::optional<QueryWatchdog::Clock::time_point> deadline = scopeDeadline;
+        if (callTimeout.count() > 0) {
+            auto callDeadline = QueryWatchdog::Clock::now() + callTimeout;
+            deadline = deadline ? std::min(*deadline, callDeadline) : callDeadline;
+        }
+        return deadline;
+    }
+
+    // Выполняет f под сроком: по его истечении запрос на сервере отменяется, а ошибка отмены
+    // (SQLSTATE 57014) превращается в DeadlineExceeded. Соединение после отмены остаётся рабочим:
+    // в автокоммите оно просто простаивает, а транзакцию откатывает её владелец
+    template<typename F>
+    auto underDeadline(std::function<void()> cancel, F&& f) {
+        TraceSpan span("server.exec", "server");
+        auto deadline = statementDeadline();
+        if (!deadline) {
+            return f();
+        }
+        if (QueryWatchdog::Clock::now() >= *deadline) {
+            throw DeadlineExceeded("Deadline expired before the query was sent.");
+        }
+        auto timer = QueryWatchdog::global().arm(*deadline, std::move(cancel));
+        try {
+            return f();
+        } catch (const pqxx::sql_error& e) {
+            if (timer.fired()) {
+                throw DeadlineExceeded(std::string("Query canceled at deadline: ") + e.what());
+            }
+            throw;
+        }
+    }
+
+    template<typename F>
+    auto underDeadline(pqxx::connection& c, F&& f) {
+        return underDeadline([&c] { c.cancel_query(); }, std::forward<F>(f));
+    }
+
+    template<typename F>
+    auto underDeadline(PGconn* pg, F&& f) {
+        if (!statementDeadline()) {
+            return underDeadline(std::function<void()>{}, std::forward<F>(f));
+        }
+        // PGcancel берётся здесь, в потоке-владельце соединения; PQcancel из потока сторожа безопасен
+        std::shared_ptr<PGcancel> handle(PQgetCancel(pg), &PQfreeCancel);
+        if (!handle) {
+            throw std::runtime_error("PQgetCancel failed.");
+        }
+        return underDeadline([handle] {
+            char error[256];
+            if (!PQcancel(handle.get(), error, sizeof(error))) {
+                throw std::runtime_error(error);
+            }
+        }, std::forward<F>(f));
+    }
+
+    // Чтение в открытой области транзакции, иначе в nontransaction
+    template<typename F>
+    auto inReadScope(pqxx::connection& c, F&& f) {
+        if (txn) {
+            return underDeadline(c, [&] { return f(static_cast<pqxx::transaction_base&>(*txn)); });
+        }
+        pqxx::nontransaction ntx(c);
+        return underDeadline(c, [&] { return f(static_cast<pqxx::transaction_base&>(ntx)); });
     }
 
-    // Выполнение SQL-запроса с параметрами
-    std::vector<std::vector<std::string>> executeQuery(const std::string& query, const std::vector<std::string>& params = {}) {
-        pqxx::nontransaction ntx(conn);
-        pqxx::result res;
+    // Запись в открытой области транзакции (фиксирует её владелец), иначе в своей транзакции
+    template<typename F>
+    void inWriteScope(pqxx::connection& c, F&& f) {
+        if (txn) {
+            underDeadline(c, [&] { f(*txn); });
+            return;
+        }
+        pqxx::work work(c);
+        try {
+            underDeadline(c, [&] { f(work); });
+            work.commit();
+        } catch (...) {
+            work.abort();
+            throw;
+        }
+    }
+
+    // Чтение вне области транзакции: на реплику, если они настроены и не отстают, иначе на основной
+    // сервер. Разрыв соединения с репликой не ошибка для вызывающего: чтение повторяется на основном.
+    // Чтение ничего не меняет, поэтому повторяется и после обрыва соединения
+    template<typename F>
+    auto routeRead(F&& run) {
+        return withRetry(true, [&] { return routeReadOnce(run); });
+    }
+
+    template<typename F>
+    auto routeReadOnce(F& run) {
+        if (replicas && !txn) {
+            if (auto read = replicas->acquire()) {
+                try {
+                    return run(read.lease());
+                } catch (const pqxx::broken_connection& e) {
+                    spdlog::warn("Replica connection lost, reading from primary: {}", e.what());
+                    read.lease().markBroken();
+                }
+            }
+        }
+        session();
+        return run(conn);
+    }
 
+    // Выполняет f(соединение, имя подготовленного запроса) на соединении lease. Если сервер потерял
+    // подготовленный запрос (SQLSTATE 26000), кеш сбрасывается и попытка повторяется один раз
+    template<typename F>
+    static auto withPrepared(ConnectionPool::Lease& lease, const std::string& query, F&& f) {
         try {
-            pqxx::prepare::named(stmt, query);  // Использование именованных запросов
-            for (size_t i = 0; i < params.size(); ++i) {
-                stmt.parameter(i + 1) = params[i];
+            return f(*lease, lease.statements().prepare(*lease, query));
+        } catch (const pqxx::sql_error& e) {
+            if (e.sqlstate() != "26000") {
+                throw;
             }
-            res = ntx.exec(stmt);
-        } catch (const std::exception& e) {
-            spdlog::error("Error executing query: {}", e.what());
-            throw;
+            spdlog::warn("Prepared statement vanished on server, re-preparing: {}", query);
+            lease.statements().clear();
+            return f(*lease, lease.statements().prepare(*lease, query));
         }
+    }
 
-        std::vector<std::vector<std::string>> result;
-        for (const auto& row : res) {
-            std::vector<std::string> rowData;
-            for (const auto& field : row) {
-                rowData.push_back(field.c_str());
+    // Как withPrepared, но для запросов реестра: если сервер их потерял, они готовятся заново
+    template<typename F>
+    static auto withRegistered(ConnectionPool::Lease& lease, F&& f) {
+        try {
+            return f(*lease);
+        } catch (const pqxx::sql_error& e) {
+            if (e.sqlstate() != "26000") {
+                throw;
             }
-            result.push_back(rowData);
+            spdlog::warn("Registered statements vanished on server, re-preparing.");
+            prepareQueries(*lease);
+            return f(*lease);
         }
+    }
 
-        return result;
+    template<typename... Params, typename... Args>
+    Task<StatementResult> sendRegistered(EventLoop& loop, const StatementDef<Params...>& stmt, const Args&... args) {
+        static_assert(sizeof...(Params) == sizeof...(Args), "Wrong number of arguments for statement");
+        static_assert(StatementDef<Params...>::template accepts<Args...>(), "Argument type does not match statement parameter");
+
+        BinaryParams<sizeof...(Params)> params(static_cast<Params>(args)...);
+        LatencyTimer timer(QueryMetrics::global().statement(stmt), SpanKind::Async);
+        StatementResult result = co_await QueryAwaiter([&](AsyncQuery::Callback callback) {
+            startAsync(loop, [&](PGconn* pg) {
+                return PQsendQueryPrepared(pg, stmt.name, params.count(), params.values(), params.lengths(),
+                                           params.formats(), 0);
+            }, std::move(callback));
+        });
+        if (result.ok) {
+            timer.result(result.rows);
+            logSlowAsync(timer, stmt.sql, [&] { return formatParams(static_cast<Params>(args)...); });
+        } else {
+            timer.fail();
+            ErrorCounters::global().record(result.sqlstate);
+        }
+        co_return result;
     }
 
-    // Выполнение SQL-запроса без возвращаемых данных
-    void executeNonQuery(const std::string& query, const std::vector<std::string>& params = {}) {
-        pqxx::work txn(conn);
+    void startAsync(EventLoop& loop, const std::string& query, const std::vector<std::string>& params,
+                    AsyncQuery::Callback callback) {
+        // Запрос может ждать соединения и после возврата отсюда, поэтому send держит копии
+        startAsync(loop, [query, params](PGconn* pg) {
+            std::vector<const char*> values;
+            values.reserve(params.size());
+            for (const auto& param : params) {
+                values.push_back(param.c_str());
+            }
+            return PQsendQueryParams(pg, query.c_str(), static_cast<int>(values.size()), nullptr, values.data(),
+                                     nullptr, nullptr, 0);
+        }, std::move(callback));
+    }
 
+    // Если свободного соединения нет, запрос встаёт в очередь пула и отправляется циклом, когда
+    // соединение вернут; поток цикла при этом не блокируется. send должна оставаться действительной
+    // до отправки. Ошибка отправки отложенного запроса приходит в callback
+    void startAsync(EventLoop& loop, std::function<int(PGconn*)> send, AsyncQuery::Callback callback) {
         try {
-            pqxx::prepare::named(stmt, query);
-            for (size_t i = 0; i < params.size(); ++i) {
-                stmt.parameter(i + 1) = params[i];
-            }
-            txn.exec(stmt);
-            txn.commit();
+            startOrQueue(loop, pool, std::move(send), std::move(callback));
         } catch (const std::exception& e) {
-            spdlog::error("Error executing non-query: {}", e.what());
-            txn.abort();
+            spdlog::error("Error starting async query: {}", e.what());
             throw;
         }
     }
 
-    // Работа с транзакциями
-    void beginTransaction() {
-        txn = std::make_unique<pqxx::work>(conn);
+    static void startOrQueue(EventLoop& loop, const std::shared_ptr<ConnectionPool>& pool,
+                             std::function<int(PGconn*)> send, AsyncQuery::Callback callback) {
+        // Вызывается из release() или потока открытия пула; дальше работа идёт в потоке цикла
+        auto whenFree = [&loop, pool, send, callback](ConnectionPool::Lease lease, std::exception_ptr error) {
+            auto handed = std::make_shared<ConnectionPool::Lease>(std::move(lease));
+            loop.post([&loop, pool, send, callback, handed, error] {
+                loop.unhold();
+                try {
+                    if (error) {
+                        std::rethrow_exception(error);
+                    }
+                    if (*handed) {
+                        auto op = std::make_shared<AsyncQuery>(loop, std::move(*handed), callback);
+                        op->start(send);
+                    } else {
+                        startOrQueue(loop, pool, send, callback);
+                    }
+                } catch (const std::exception& e) {
+                    spdlog::error("Error starting async query: {}", e.what());
+                    StatementResult failed;
+                    failed.error = e.what();
+                    callback(std::move(failed));
+                }
+            });
+        };
+
+        loop.hold();
+        ConnectionPool::Lease lease;
+        try {
+            lease = pool->tryAcquire(whenFree);
+        } catch (...) {
+            loop.unhold();
+            throw;
+        }
+        if (lease) {
+            loop.unhold();
+            auto op = std::make_shared<AsyncQuery>(loop, std::move(lease), std::move(callback));
+            op->start(send);
+        }
     }
 
-    void commitTransaction() {
-        if (txn) {
-            txn->commit();
+    static void sendPipeline(PGconn* pg, const std::vector<std::string>& names, const std::vector<Statement>& statements) {
+        if (PQsetnonblocking(pg, 1) != 0 || PQenterPipelineMode(pg) != 1) {
+            throw std::runtime_error(std::string("Failed to enter pipeline mode: ") + PQerrorMessage(pg));
+        }
+
+        std::vector<const char*> values;
+        for (size_t i = 0; i < statements.size(); ++i) {
+            values.clear();
+            for (const auto& param : statements[i].params) {
+                values.push_back(param.c_str());
+            }
+            // Sync после каждого запроса делает его отдельной неявной транзакцией
+            if (PQsendQueryPrepared(pg, names[i].c_str(), static_cast<int>(values.size()), values.data(),
+                                    nullptr, nullptr, 0) != 1 ||
+                PQpipelineSync(pg) != 1) {
+                throw std::runtime_error(std::string("Failed to queue pipelined statement: ") + PQerrorMessage(pg));
+            }
+            flushPipeline(pg, false);
         }
+        flushPipeline(pg, true);
     }
 
-    void rollbackTransaction() {
-        if (txn) {
-            txn->abort();
+    // Отправка буфера без блокировки. Пока сервер не может принять данные, входящие ответы
+    // вычитываются в буфер libpq, иначе обе стороны могут встать на заполненных сокетах
+    static void flushPipeline(PGconn* pg, bool untilEmpty) {
+        int pending;
+        while ((pending = PQflush(pg)) == 1 && untilEmpty) {
+            pollfd pfd{PQsocket(pg), POLLIN | POLLOUT, 0};
+            if (poll(&pfd, 1, -1) < 0) {
+                throw std::runtime_error("poll() failed while flushing pipeline.");
+            }
+            if ((pfd.revents & POLLIN) && PQconsumeInput(pg) != 1) {
+                throw std::runtime_error(std::string("Connection lost during pipeline: ") + PQerrorMessage(pg));
+            }
+        }
+        if (pending < 0) {
+            throw std::runtime_error(std::string("Failed to flush pipeline: ") + PQerrorMessage(pg));
         }
     }
 
-    ~DatabaseConnection() {
-        if (conn.is_open()) {
-            conn.close();
+    static std::vector<StatementResult> collectPipeline(PGconn* pg, size_t count) {
+        std::vector<StatementResult> results(count);
+        for (auto& result : results) {
+            // Результаты запроса, затем nullptr, затем маркер PGRES_PIPELINE_SYNC
+            while (PGresult* raw = PQgetResult(pg)) {
+                PgResult res(raw, &PQclear);
+                applyResult(result, res.get());
+            }
+            PgResult sync(PQgetResult(pg), &PQclear);
+            if (!sync || PQresultStatus(sync.get()) != PGRES_PIPELINE_SYNC) {
+                throw std::runtime_error(std::string("Pipeline out of sync: ") + PQerrorMessage(pg));
+            }
+        }
+
+        if (PQexitPipelineMode(pg) != 1 || PQsetnonblocking(pg, 0) != 0) {
+            throw std::runtime_error(std::string("Failed to leave pipeline mode: ") + PQerrorMessage(pg));
         }
+        return results;
     }
 
-private:
-    pqxx::connection conn;
-    pqxx::prepare::declaration stmt;
+    std::shared_ptr<ConnectionPool> pool;
+    std::shared_ptr<ReplicaSet> replicas;  // nullptr, если реплики для этого сервера не настроены
+    std::shared_ptr<WriteCoalescer> coalescer;  // nullptr, если групповой коммит не включён
+    ConnectionPool::Lease conn;
+    RetryPolicy retryPolicy;
+    ResultLimits resultLimits;
+    std::chrono::milliseconds callTimeout{0};
+    std::optional<QueryWatchdog::Clock::time_point> scopeDeadline;
+    std::unordered_map<std::type_index, std::unordered_set<std::string>> checkedRowTypes;  // Запросы, уже сверенные с типом строки
     std::unique_ptr<pqxx::work> txn;
 };
 
@@ -102,184 +4114,623 @@ public:
     virtual void createOrder() = 0;
     virtual void cancelOrder(int orderId) = 0;
     virtual void returnOrder(int orderId) = 0;
+
+    // Корутинные версии тех же операций, выполняются на цикле событий loop
+    virtual Task<void> viewOrderStatus(EventLoop& loop, int orderId) = 0;
+    virtual Task<void> createOrder(EventLoop& loop) = 0;
+    virtual Task<void> cancelOrder(EventLoop& loop, int orderId) = 0;
+    virtual Task<void> returnOrder(EventLoop& loop, int orderId) = 0;
+
     virtual ~User() = default;
 };
 
+// Строка каталога для массовой загрузки
+struct ProductRow {
+    std::string name;
+    double price;
+    int stock;
+};
+
+// Строка корзины для Customer::addItemsToOrder
+struct OrderLine {
+    int productId;
+    int quantity;
+};
+
+// Строка списка заказов
+struct OrderRow {
+    using Columns = std::tuple<int, std::string>;
+
+    int orderId;
+    std::string status;
+
+    int key() const { return orderId; }
+};
+
+// Строка списка товаров
+struct CatalogRow {
+    using Columns = std::tuple<int, std::string, double, int>;
+
+    int productId;
+    std::string name;
+    double price;
+    int stock;
+
+    int key() const { return productId; }
+};
+
+// Итог массовой загрузки: сколько строк загружено и какие отвергнуты (индекс во входных данных)
+struct BulkLoadReport {
+    struct RowError {
+        size_t index;
+        std::string message;
+    };
+
+    size_t loaded = 0;
+    std::vector<RowError> errors;
+
+    // Загрузка прервана не ошибкой строки (обрыв соединения, сбой источника): строки, начиная
+    // с stoppedAt, не загружены и в errors не попали
+    bool aborted = false;
+    size_t stoppedAt = 0;
+    std::string abortReason;
+};
+
 // Класс Администратора
 class Admin : public User {
 public:
     void viewOrderStatus(int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Admin.viewOrderStatus"));
         try {
             std::cout << "Viewing status of order ID " << orderId << " as Admin." << std::endl;
-            dbConn.executeQuery("SELECT status FROM orders WHERE order_id = $1", {std::to_string(orderId)});
+            dbConn.executeQueryView(Queries::selectOrderStatus, orderId);
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error viewing order status: {}", e.what());
         }
     }
 
     void createOrder() override {
+        LatencyTimer timer(QueryMetrics::global().operation("Admin.createOrder"));
         try {
             std::cout << "Admin creates a new order." << std::endl;
-            dbConn.executeNonQuery("INSERT INTO orders (status) VALUES ($1)", {"pending"});
+            dbConn.execute(Queries::insertOrder, "pending");
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error creating order: {}", e.what());
         }
     }
 
     void cancelOrder(int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Admin.cancelOrder"));
         try {
             std::cout << "Admin cancels order ID " << orderId << std::endl;
-            dbConn.executeNonQuery("UPDATE orders SET status = $1 WHERE order_id = $2", {"canceled", std::to_string(orderId)});
+            dbConn.execute(Queries::updateOrderStatus, "canceled", orderId);
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error canceling order: {}", e.what());
         }
     }
 
     void returnOrder(int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Admin.returnOrder"));
         try {
             std::cout << "Admin returns order ID " << orderId << std::endl;
-            dbConn.executeNonQuery("UPDATE orders SET status = $1 WHERE order_id = $2", {"returned", std::to_string(orderId)});
+            dbConn.execute(Queries::updateOrderStatus, "returned", orderId);
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error returning order: {}", e.what());
         }
     }
 
     void addProduct(const std::string& name, double price, int stock) {
+        LatencyTimer timer(QueryMetrics::global().operation("Admin.addProduct"));
         try {
             std::cout << "Admin adds a new product: " << name << std::endl;
-            dbConn.executeNonQuery("INSERT INTO products (name, price, stock_quantity) VALUES ($1, $2, $3)", 
-                                    {name, std::to_string(price), std::to_string(stock)});
+            dbConn.execute(Queries::insertProduct, name, price, stock);
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error adding product: {}", e.what());
         }
     }
 
     void deleteProduct(int productId) {
+        LatencyTimer timer(QueryMetrics::global().operation("Admin.deleteProduct"));
+        try {
+            std::cout << "Admin deletes product with ID: " << productId << std::endl;
+            dbConn.execute(Queries::deleteProduct, productId);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error deleting product: {}", e.what());
+        }
+    }
+
+    using ProductSource = std::function<std::optional<ProductRow>()>;
+    using ProgressCallback = std::function<void(size_t processed)>;
+
+    // Массовая загрузка каталога через COPY пачками по chunkSize строк. Источник отдаёт строки,
+    // пока не вернёт std::nullopt. Если сервер отверг пачку, она догружается одной транзакцией
+    // с точками сохранения (executeBatch), чтобы отчёт указал на конкретные плохие строки; прочие
+    // сбои прерывают загрузку (aborted, stoppedAt)
+    BulkLoadReport addProducts(const ProductSource& next, size_t chunkSize = 10000, const ProgressCallback& progress = {}) {
+        BulkLoadReport report;
+        std::vector<std::tuple<std::string, double, int>> chunk;
+        chunk.reserve(chunkSize);
+        size_t processed = 0;
+
+        auto flush = [&]() {
+            if (chunk.empty()) {
+                return;
+            }
+            size_t first = processed - chunk.size();
+            try {
+                dbConn.copyRows("products", {"name", "price", "stock_quantity"}, chunk);
+                report.loaded += chunk.size();
+            } catch (const pqxx::sql_error& e) {
+                // Повтор пачки только для отвергнутых данных. Сбой соединения, in_doubt на COMMIT (COPY мог
+                // и зафиксироваться, а естественного ключа у products нет) и истёкший срок уходят наверх
+                if (e.sqlstate() == "57014") {
+                    throw;
+                }
+                spdlog::warn("COPY of rows {}..{} failed, retrying as a savepoint batch: {}", first, processed - 1, e.what());
+                BatchReport batch = dbConn.executeBatch(Queries::insertProduct, chunk);
+                report.loaded += batch.succeeded;
+                for (const auto& failure : batch.failed) {
+                    report.errors.push_back({first + failure.index, failure.message});
+                }
+            }
+            chunk.clear();
+            if (progress) {
+                progress(processed);
+            }
+        };
+
+        try {
+            std::cout << "Admin bulk loads products." << std::endl;
+            while (auto row = next()) {
+                chunk.emplace_back(std::move(row->name), row->price, row->stock);
+                ++processed;
+                if (chunk.size() >= chunkSize) {
+                    flush();
+                }
+            }
+            flush();
+        } catch (const std::exception& e) {
+            // Незагруженная пачка ещё не очищена: загрузка остановилась на её первой строке
+            report.aborted = true;
+            report.stoppedAt = processed - chunk.size();
+            report.abortReason = e.what();
+            spdlog::error("Bulk product load aborted at row {}: {}", report.stoppedAt, e.what());
+        }
+
+        spdlog::info("Bulk product load: {} loaded, {} rejected{}.", report.loaded, report.errors.size(),
+                     report.aborted ? ", aborted" : "");
+        return report;
+    }
+
+    BulkLoadReport addProducts(const std::vector<ProductRow>& products, size_t chunkSize = 10000, const ProgressCallback& progress = {}) {
+        size_t i = 0;
+        return addProducts([&]() -> std::optional<ProductRow> {
+            if (i == products.size()) {
+                return std::nullopt;
+            }
+            return products[i++];
+        }, chunkSize, progress);
+    }
+
+    // Товары с остатком меньше threshold, по возрастанию product_id. Первая страница — пустой token,
+    // следующая — Page::next предыдущей
+    Page<CatalogRow> listLowStock(int threshold, int pageSize = 50, const std::string& token = {}) {
+        LatencyTimer timer(QueryMetrics::global().operation("Admin.listLowStock"));
+        try {
+            return dbConn.executePage<CatalogRow>(Queries::selectLowStock, token, pageSize, threshold);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error listing low-stock products: {}", e.what());
+            return {};
+        }
+    }
+
+    Task<void> viewOrderStatus(EventLoop& loop, int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Admin.viewOrderStatus.async"), SpanKind::Async);
+        try {
+            std::cout << "Viewing status of order ID " << orderId << " as Admin." << std::endl;
+            co_await dbConn.executeQuery(loop, Queries::selectOrderStatus, orderId);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error viewing order status: {}", e.what());
+        }
+    }
+
+    Task<void> createOrder(EventLoop& loop) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Admin.createOrder.async"), SpanKind::Async);
+        try {
+            std::cout << "Admin creates a new order." << std::endl;
+            co_await dbConn.execute(loop, Queries::insertOrder, "pending");
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error creating order: {}", e.what());
+        }
+    }
+
+    Task<void> cancelOrder(EventLoop& loop, int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Admin.cancelOrder.async"), SpanKind::Async);
+        try {
+            std::cout << "Admin cancels order ID " << orderId << std::endl;
+            co_await dbConn.execute(loop, Queries::updateOrderStatus, "canceled", orderId);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error canceling order: {}", e.what());
+        }
+    }
+
+    Task<void> returnOrder(EventLoop& loop, int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Admin.returnOrder.async"), SpanKind::Async);
+        try {
+            std::cout << "Admin returns order ID " << orderId << std::endl;
+            co_await dbConn.execute(loop, Queries::updateOrderStatus, "returned", orderId);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error returning order: {}", e.what());
+        }
+    }
+
+    Task<void> addProduct(EventLoop& loop, std::string name, double price, int stock) {
+        LatencyTimer timer(QueryMetrics::global().operation("Admin.addProduct.async"), SpanKind::Async);
+        try {
+            std::cout << "Admin adds a new product: " << name << std::endl;
+            co_await dbConn.execute(loop, Queries::insertProduct, name, price, stock);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error adding product: {}", e.what());
+        }
+    }
+
+    Task<void> deleteProduct(EventLoop& loop, int productId) {
+        LatencyTimer timer(QueryMetrics::global().operation("Admin.deleteProduct.async"), SpanKind::Async);
         try {
             std::cout << "Admin deletes product with ID: " << productId << std::endl;
-            dbConn.executeNonQuery("DELETE FROM products WHERE product_id = $1", {std::to_string(productId)});
+            co_await dbConn.execute(loop, Queries::deleteProduct, productId);
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error deleting product: {}", e.what());
         }
     }
 
+    static constexpr const char* connStr = "dbname=shopdb user=admin password=admin";
+
 private:
-    DatabaseConnection<pqxx::connection> dbConn{"dbname=shopdb user=admin password=admin"};
+    DatabaseConnection<pqxx::connection> dbConn{connStr};
 };
 
 // Класс Менеджера
 class Manager : public User {
 public:
     void viewOrderStatus(int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Manager.viewOrderStatus"));
         try {
             std::cout << "Viewing status of order ID " << orderId << " as Manager." << std::endl;
-            dbConn.executeQuery("SELECT status FROM orders WHERE order_id = $1", {std::to_string(orderId)});
+            dbConn.executeQueryView(Queries::selectOrderStatus, orderId);
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error viewing order status: {}", e.what());
         }
     }
 
     void createOrder() override {
+        LatencyTimer timer(QueryMetrics::global().operation("Manager.createOrder"));
         try {
             std::cout << "Manager creates a new order." << std::endl;
-            dbConn.executeNonQuery("INSERT INTO orders (status) VALUES ($1)", {"pending"});
+            dbConn.execute(Queries::insertOrder, "pending");
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error creating order: {}", e.what());
         }
     }
 
     void cancelOrder(int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Manager.cancelOrder"));
         try {
             std::cout << "Manager cancels order ID " << orderId << std::endl;
-            dbConn.executeNonQuery("UPDATE orders SET status = $1 WHERE order_id = $2", {"canceled", std::to_string(orderId)});
+            dbConn.execute(Queries::updateOrderStatus, "canceled", orderId);
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error canceling order: {}", e.what());
         }
     }
 
     void returnOrder(int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Manager.returnOrder"));
         try {
             std::cout << "Manager returns order ID " << orderId << std::endl;
-            dbConn.executeNonQuery("UPDATE orders SET status = $1 WHERE order_id = $2", {"returned", std::to_string(orderId)});
+            dbConn.execute(Queries::updateOrderStatus, "returned", orderId);
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error returning order: {}", e.what());
         }
     }
 
     void approveOrder(int orderId) {
+        LatencyTimer timer(QueryMetrics::global().operation("Manager.approveOrder"));
+        try {
+            std::cout << "Manager approves order ID " << orderId << std::endl;
+            dbConn.execute(Queries::updateOrderStatus, "approved", orderId);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error approving order: {}", e.what());
+        }
+    }
+
+    // Заказы в статусе status, по возрастанию order_id. Первая страница — пустой token,
+    // следующая — Page::next предыдущей
+    Page<OrderRow> listOrders(const std::string& status = "pending", int pageSize = 50, const std::string& token = {}) {
+        LatencyTimer timer(QueryMetrics::global().operation("Manager.listOrders"));
+        try {
+            return dbConn.executePage<OrderRow>(Queries::selectOrdersByStatus, token, pageSize, status);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error listing orders: {}", e.what());
+            return {};
+        }
+    }
+
+    Task<void> viewOrderStatus(EventLoop& loop, int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Manager.viewOrderStatus.async"), SpanKind::Async);
+        try {
+            std::cout << "Viewing status of order ID " << orderId << " as Manager." << std::endl;
+            co_await dbConn.executeQuery(loop, Queries::selectOrderStatus, orderId);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error viewing order status: {}", e.what());
+        }
+    }
+
+    Task<void> createOrder(EventLoop& loop) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Manager.createOrder.async"), SpanKind::Async);
+        try {
+            std::cout << "Manager creates a new order." << std::endl;
+            co_await dbConn.execute(loop, Queries::insertOrder, "pending");
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error creating order: {}", e.what());
+        }
+    }
+
+    Task<void> cancelOrder(EventLoop& loop, int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Manager.cancelOrder.async"), SpanKind::Async);
+        try {
+            std::cout << "Manager cancels order ID " << orderId << std::endl;
+            co_await dbConn.execute(loop, Queries::updateOrderStatus, "canceled", orderId);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error canceling order: {}", e.what());
+        }
+    }
+
+    Task<void> returnOrder(EventLoop& loop, int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Manager.returnOrder.async"), SpanKind::Async);
+        try {
+            std::cout << "Manager returns order ID " << orderId << std::endl;
+            co_await dbConn.execute(loop, Queries::updateOrderStatus, "returned", orderId);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error returning order: {}", e.what());
+        }
+    }
+
+    Task<void> approveOrder(EventLoop& loop, int orderId) {
+        LatencyTimer timer(QueryMetrics::global().operation("Manager.approveOrder.async"), SpanKind::Async);
         try {
             std::cout << "Manager approves order ID " << orderId << std::endl;
-            dbConn.executeNonQuery("UPDATE orders SET status = $1 WHERE order_id = $2", {"approved", std::to_string(orderId)});
+            co_await dbConn.execute(loop, Queries::updateOrderStatus, "approved", orderId);
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error approving order: {}", e.what());
         }
     }
 
+    static constexpr const char* connStr = "dbname=shopdb user=manager password=manager";
+
 private:
-    DatabaseConnection<pqxx::connection> dbConn{"dbname=shopdb user=manager password=manager"};
+    DatabaseConnection<pqxx::connection> dbConn{connStr};
 };
 
 // Класс Покупателя
 class Customer : public User {
 public:
     void viewOrderStatus(int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.viewOrderStatus"));
         try {
             std::cout << "Viewing status of order ID " << orderId << " as Customer." << std::endl;
-            dbConn.executeQuery("SELECT status FROM orders WHERE order_id = $1", {std::to_string(orderId)});
+            dbConn.executeQueryView(Queries::selectOrderStatus, orderId);
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error viewing order status: {}", e.what());
         }
     }
 
     void createOrder() override {
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.createOrder"));
         try {
             std::cout << "Customer creates a new order." << std::endl;
-            dbConn.executeNonQuery("INSERT INTO orders (status) VALUES ($1)", {"pending"});
+            dbConn.execute(Queries::insertOrder, "pending");
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error creating order: {}", e.what());
         }
     }
 
     void cancelOrder(int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.cancelOrder"));
         try {
             std::cout << "Customer cancels order ID " << orderId << std::endl;
-            dbConn.executeNonQuery("UPDATE orders SET status = $1 WHERE order_id = $2", {"canceled", std::to_string(orderId)});
+            dbConn.execute(Queries::updateOrderStatus, "canceled", orderId);
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error canceling order: {}", e.what());
         }
     }
 
     void returnOrder(int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.returnOrder"));
         try {
             std::cout << "Customer returns order ID " << orderId << std::endl;
-            dbConn.executeNonQuery("UPDATE orders SET status = $1 WHERE order_id = $2", {"returned", std::to_string(orderId)});
+            dbConn.execute(Queries::updateOrderStatus, "returned", orderId);
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error returning order: {}", e.what());
         }
     }
 
     void addToOrder(int orderId, int productId, int quantity) {
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.addToOrder"));
         try {
             std::cout << "Customer adds product ID " << productId << " to order ID " << orderId << std::endl;
-            dbConn.executeNonQuery("INSERT INTO order_items (order_id, product_id, quantity) VALUES ($1, $2, $3)",
-                                    {std::to_string(orderId), std::to_string(productId), std::to_string(quantity)});
+            dbConn.execute(Queries::insertOrderItem, orderId, productId, quantity);
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error adding product to order: {}", e.what());
         }
     }
 
+    // Вся корзина одним запросом (unnest по массивам) и одним COMMIT, сколько бы в ней ни было строк
+    void addItemsToOrder(int orderId, std::span<const OrderLine> lines) {
+        if (lines.empty()) {
+            return;
+        }
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.addItemsToOrder"));
+        try {
+            std::cout << "Customer adds " << lines.size() << " products to order ID " << orderId << std::endl;
+            auto [productIds, quantities] = splitLines(lines);
+            dbConn.execute(Queries::insertOrderItems, orderId, productIds, quantities);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error adding products to order: {}", e.what());
+        }
+    }
+
     void removeFromOrder(int orderId, int productId) {
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.removeFromOrder"));
+        try {
+            std::cout << "Customer removes product ID " << productId << " from order ID " << orderId << std::endl;
+            dbConn.execute(Queries::deleteOrderItem, orderId, productId);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error removing product from order: {}", e.what());
+        }
+    }
+
+    // Каталог товаров по возрастанию product_id. Первая страница — пустой token,
+    // следующая — Page::next предыдущей
+    Page<CatalogRow> browseCatalog(int pageSize = 50, const std::string& token = {}) {
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.browseCatalog"));
+        try {
+            return dbConn.executePage<CatalogRow>(Queries::selectCatalog, token, pageSize);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error browsing catalog: {}", e.what());
+            return {};
+        }
+    }
+
+    Task<void> viewOrderStatus(EventLoop& loop, int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.viewOrderStatus.async"), SpanKind::Async);
+        try {
+            std::cout << "Viewing status of order ID " << orderId << " as Customer." << std::endl;
+            co_await dbConn.executeQuery(loop, Queries::selectOrderStatus, orderId);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error viewing order status: {}", e.what());
+        }
+    }
+
+    Task<void> createOrder(EventLoop& loop) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.createOrder.async"), SpanKind::Async);
+        try {
+            std::cout << "Customer creates a new order." << std::endl;
+            co_await dbConn.execute(loop, Queries::insertOrder, "pending");
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error creating order: {}", e.what());
+        }
+    }
+
+    Task<void> cancelOrder(EventLoop& loop, int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.cancelOrder.async"), SpanKind::Async);
+        try {
+            std::cout << "Customer cancels order ID " << orderId << std::endl;
+            co_await dbConn.execute(loop, Queries::updateOrderStatus, "canceled", orderId);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error canceling order: {}", e.what());
+        }
+    }
+
+    Task<void> returnOrder(EventLoop& loop, int orderId) override {
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.returnOrder.async"), SpanKind::Async);
+        try {
+            std::cout << "Customer returns order ID " << orderId << std::endl;
+            co_await dbConn.execute(loop, Queries::updateOrderStatus, "returned", orderId);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error returning order: {}", e.what());
+        }
+    }
+
+    Task<void> addToOrder(EventLoop& loop, int orderId, int productId, int quantity) {
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.addToOrder.async"), SpanKind::Async);
+        try {
+            std::cout << "Customer adds product ID " << productId << " to order ID " << orderId << std::endl;
+            co_await dbConn.execute(loop, Queries::insertOrderItem, orderId, productId, quantity);
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error adding product to order: {}", e.what());
+        }
+    }
+
+    Task<void> addItemsToOrder(EventLoop& loop, int orderId, std::span<const OrderLine> lines) {
+        if (lines.empty()) {
+            co_return;
+        }
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.addItemsToOrder.async"), SpanKind::Async);
+        try {
+            std::cout << "Customer adds " << lines.size() << " products to order ID " << orderId << std::endl;
+            auto [productIds, quantities] = splitLines(lines);
+            co_await dbConn.execute(loop, Queries::insertOrderItems, orderId, std::move(productIds), std::move(quantities));
+        } catch (const std::exception& e) {
+            timer.fail();
+            spdlog::error("Error adding products to order: {}", e.what());
+        }
+    }
+
+    Task<void> removeFromOrder(EventLoop& loop, int orderId, int productId) {
+        LatencyTimer timer(QueryMetrics::global().operation("Customer.removeFromOrder.async"), SpanKind::Async);
         try {
             std::cout << "Customer removes product ID " << productId << " from order ID " << orderId << std::endl;
-            dbConn.executeNonQuery("DELETE FROM order_items WHERE order_id = $1 AND product_id = $2",
-                                    {std::to_string(orderId), std::to_string(productId)});
+            co_await dbConn.execute(loop, Queries::deleteOrderItem, orderId, productId);
         } catch (const std::exception& e) {
+            timer.fail();
             spdlog::error("Error removing product from order: {}", e.what());
         }
     }
 
+    static constexpr const char* connStr = "dbname=shopdb user=customer password=customer";
+
 private:
-    DatabaseConnection<pqxx::connection> dbConn{"dbname=shopdb user=customer password=customer"};
+    // Корзина раскладывается на два массива для unnest в insertOrderItems
+    static std::pair<std::vector<int>, std::vector<int>> splitLines(std::span<const OrderLine> lines) {
+        std::vector<int> productIds;
+        std::vector<int> quantities;
+        productIds.reserve(lines.size());
+        quantities.reserve(lines.size());
+        for (const auto& line : lines) {
+            productIds.push_back(line.productId);
+            quantities.push_back(line.quantity);
+        }
+        return {std::move(productIds), std::move(quantities)};
+    }
+
+    DatabaseConnection<pqxx::connection> dbConn{connStr};
 };
 
 // Меню программы
@@ -288,12 +4739,21 @@ void showMainMenu() {
     std::cout << "2. Login as Manager\n";
     std::cout << "3. Login as Customer\n";
     std::cout << "4. Exit\n";
+    std::cout << "5. Show query statistics\n";
+    std::cout << "6. Start/stop tracing to trace.json\n";
 }
 
 // Главная функция
 int main() {
     // Настройка логирования
     auto logger = spdlog::basic_logger_mt("basic_logger", "logs.txt");
+    SlowQueryLog::global().enable({});  // Только текст и время; планы EXPLAIN выключены
+    MetricsExporter metrics("metrics.prom", std::chrono::seconds(15));
+
+    // Соединения ролей открываются в фоне, пока пользователь выбирает пункт меню
+    for (const char* connStr : {Admin::connStr, Manager::connStr, Customer::connStr}) {
+        ConnectionPool::shared(connStr, defaultPoolOptions())->warmUpAsync();
+    }
 
     bool running = true;
     while (running) {
@@ -325,6 +4785,27 @@ int main() {
             case 4:
                 running = false;
                 break;
+            case 5:
+                QueryMetrics::global().dump(std::cout);
+                try {
+                    QueryMetrics::global().dumpToFile("query_stats.txt");
+                } catch (const std::exception& e) {
+                    spdlog::error("Error writing query statistics: {}", e.what());
+                }
+                break;
+            case 6:
+                try {
+                    if (TraceRecorder::global().enabled()) {
+                        TraceRecorder::global().stop();
+                        std::cout << "Trace written to trace.json.\n";
+                    } else {
+                        TraceRecorder::global().start("trace.json");
+                        std::cout << "Tracing to trace.json.\n";
+                    }
+                } catch (const std::exception& e) {
+                    spdlog::error("Error toggling tracing: {}", e.what());
+                }
+                break;
             default:
                 std::cout << "Invalid choice. Please try again.\n";
                 break;